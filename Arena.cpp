@@ -0,0 +1,214 @@
+/*------------------------------------------------------------------------------
+
+   MiniLight C : minimal global illumination renderer
+   Harrison Ainsworth / HXA7241 : 2009, 2011, 2013
+
+   http://www.hxa.name/minilight
+
+------------------------------------------------------------------------------*/
+
+
+#include <stddef.h>   // HEADER
+#include <stdlib.h>
+#include <assert.h>
+
+
+
+
+/**
+ * Bump allocator.<br/><br/>
+ *
+ * Allocations are cut from big chunks, and given back only all together
+ * (ArenaFree), or back to a mark in stack order (scratch space for
+ * recursion). Chunks given back to a mark are kept for reuse.
+ *
+ * @invariants
+ * * pCurrent is 0, or in the list from pFirst
+ * * chunks after pCurrent are unused
+ */
+
+// HEADERBEG
+struct ArenaChunk;
+
+struct Arena
+{
+   struct ArenaChunk* pFirst;
+   struct ArenaChunk* pCurrent;
+   size_t             chunkSize;
+};
+
+typedef struct Arena Arena;
+
+struct ArenaMark
+{
+   struct ArenaChunk* pChunk;
+   size_t             used;
+};
+
+typedef struct ArenaMark ArenaMark;
+// HEADEREND
+
+struct ArenaChunk
+{
+   struct ArenaChunk* pNext;
+   size_t             size;
+   size_t             used;
+   /* data follows, aligned */
+};
+
+
+/* constants ---------------------------------------------------------------- */
+
+/* enough for any of V3f, pointers, and SSE loads */
+static const size_t ARENA_ALIGN = 16;
+
+static const size_t ARENA_HEAD = (sizeof(ArenaChunk) + 15) & ~(size_t)15;
+
+
+
+
+/* initialisation ----------------------------------------------------------- */
+
+// HEADERBEG
+void ArenaInit
+(
+   Arena* pA,
+   size_t chunkSize
+)
+// HEADEREND
+{
+   pA->pFirst    = 0;
+   pA->pCurrent  = 0;
+   pA->chunkSize = chunkSize;
+}
+
+
+// HEADERBEG
+void ArenaFree
+(
+   Arena* pA
+)
+// HEADEREND
+{
+   for( ArenaChunk* pC = pA->pFirst;  pC; )
+   {
+      ArenaChunk* pNext = pC->pNext;
+      free( pC );
+      pC = pNext;
+   }
+   pA->pFirst   = 0;
+   pA->pCurrent = 0;
+}
+
+
+
+
+/* commands ----------------------------------------------------------------- */
+
+/**
+ * @return uninitialised memory, aligned to 16 bytes
+ */
+// HEADERBEG
+void* ArenaAlloc
+(
+   Arena* pA,
+   size_t bytes
+)
+// HEADEREND
+{
+   bytes = (bytes + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+   ArenaChunk* pC = pA->pCurrent;
+   if( !pC || (pC->used + bytes > pC->size) )
+   {
+      /* next unused chunk, if big enough */
+      ArenaChunk* pNext = pC ? pC->pNext : pA->pFirst;
+      if( pNext && (bytes <= pNext->size) )
+      {
+         pC = pNext;
+         pC->used = 0;
+      }
+      /* else replace the unused ones by a bigger one -- doubling, so a few
+         chunks end up serving any pattern, and are reused warm */
+      else
+      {
+         size_t size = pA->chunkSize;
+         if( pC && (size < pC->size * 2) ) size = pC->size * 2;
+         if( pNext && (size < pNext->size * 2) ) size = pNext->size * 2;
+         if( size < bytes ) size = bytes;
+
+         while( pNext )
+         {
+            ArenaChunk* p = pNext->pNext;
+            free( pNext );
+            pNext = p;
+         }
+
+         ArenaChunk* pNew;
+         assert( pNew = (ArenaChunk*)malloc( ARENA_HEAD + size ));
+         pNew->size  = size;
+         pNew->used  = 0;
+         pNew->pNext = 0;
+         if( pC ) pC->pNext = pNew;  else pA->pFirst = pNew;
+         pC = pNew;
+      }
+      pA->pCurrent = pC;
+   }
+
+   void* p = (char*)pC + ARENA_HEAD + pC->used;
+   pC->used += bytes;
+   return p;
+}
+
+
+// HEADERBEG
+ArenaMark ArenaGetMark
+(
+   const Arena* pA
+)
+// HEADEREND
+{
+   ArenaMark m;
+   m.pChunk = pA->pCurrent;
+   m.used   = pA->pCurrent ? pA->pCurrent->used : 0;
+   return m;
+}
+
+
+/**
+ * Give back everything allocated since the mark was got.
+ */
+// HEADERBEG
+void ArenaReset
+(
+   Arena*    pA,
+   ArenaMark mark
+)
+// HEADEREND
+{
+   pA->pCurrent = mark.pChunk;
+   if( mark.pChunk ) mark.pChunk->used = mark.used;
+}
+
+
+
+
+/* queries ------------------------------------------------------------------ */
+
+/**
+ * @return bytes held (chunks, used or not)
+ */
+// HEADERBEG
+size_t ArenaBytes
+(
+   const Arena* pA
+)
+// HEADEREND
+{
+   size_t bytes = 0;
+   for( const ArenaChunk* pC = pA->pFirst;  pC;  pC = pC->pNext )
+   {
+      bytes += ARENA_HEAD + pC->size;
+   }
+   return bytes;
+}
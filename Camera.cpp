@@ -7,12 +7,15 @@
 
 ------------------------------------------------------------------------------*/
 
-#include <setjmp.h>  // HEADER
 #include <stdio.h>   // HEADER
 #include <math.h>
+#include <stdlib.h>
 #include <assert.h>
 #include <stdint.h>
 #include <string.h>
+#include <atomic>    // HEADER
+#include <mutex>
+#include <omp.h>
 
 #include <V3f.h>   // HEADER
 #include <hdr.h>   // HEADER
@@ -21,6 +24,9 @@
 #include <Random.h>  // HEADER
 
 #include <globals.h>
+#include <prof.h>
+#include <perfctr.h>
+#include <numa.h>
 
 
 // HEADERBEG
@@ -33,6 +39,17 @@
 // HEADEREND
 
 
+/* options ------------------------------------------------------------------ */
+
+/* pixel step of CameraFrame(): 1 traces every pixel, n traces one pixel in
+   each n*n block and fills the block with it (preview while moving) */
+int CameraFrameStep;   // HEADER
+
+/* cancel token of CameraFrame(): if set, the frame is abandoned as soon as
+   the value changes, checked between tiles */
+const std::atomic<unsigned>* CameraFrameEpoch;   // HEADER
+
+
 /**
  * View definition and rasterizer.<br/><br/>
  *
@@ -139,10 +156,230 @@ Camera *CameraCreate()   // HEADER
 
 
 
+/* implementation ----------------------------------------------------------- */
+
+/* tile side in pixels: directions, radiances and hits of a tile stay in L1
+   -- a multiple of the preview steps, so blocks do not straddle tiles */
+#define CAMERA_TILE    16
+
+
+/* tile grid, follows W and H -- the per tile state below is sized by
+   tilesResize */
+static int        tilesX;
+static int        tilesLength;
+
+
+/* per thread double-ended queue of tile indexs: the owner takes from the
+   head, thieves take from the tail */
+struct TileQueue
+{
+   std::mutex lock;
+   int        head;
+   int        tail;
+   int*       aTiles;
+};
+
+static TileQueue* aTileQueues;
+static int        tileQueuesLength;
+
+/* time of each tile in the last frame that did it, in ns */
+static float*     aTileCosts;
+/* tiles done since the last complete frame -- cancelled frames leave some
+   behind, and those go first next time */
+static unsigned*  aTilePasses;
+/* own random stream per tile, seeded serially: the image does not depend
+   on which thread gets which tile */
+static Random*    aTileRandoms;
+static int*       aTileOrder;
+
+
+/* (re)make the per tile state for the current resolution and thread count,
+   keeping it when neither changed */
+static void tilesResize( const int threads )
+{
+   const int x = (W + CAMERA_TILE - 1) / CAMERA_TILE;
+   const int y = (H + CAMERA_TILE - 1) / CAMERA_TILE;
+   const bool newGrid = (x != tilesX) || (x * y != tilesLength);
+
+   if( newGrid )
+   {
+      tilesX      = x;
+      tilesLength = x * y;
+
+      free( aTileCosts );
+      free( aTilePasses );
+      free( aTileRandoms );
+      free( aTileOrder );
+      assert( aTileCosts   = (float*)   calloc( tilesLength, sizeof(float) ));
+      assert( aTilePasses  = (unsigned*)calloc( tilesLength, sizeof(unsigned) ));
+      assert( aTileRandoms = (Random*)  malloc( tilesLength * sizeof(Random) ));
+      assert( aTileOrder   = (int*)     malloc( tilesLength * sizeof(int) ));
+   }
+
+   if( newGrid || (tileQueuesLength < threads) )
+   {
+      for( int i = 0;  i < tileQueuesLength;  ++i )
+      {
+         free( aTileQueues[i].aTiles );
+      }
+      delete[] aTileQueues;
+
+      tileQueuesLength = tileQueuesLength > threads ? tileQueuesLength : threads;
+      aTileQueues      = new TileQueue[tileQueuesLength];
+      for( int i = 0;  i < tileQueuesLength;  ++i )
+      {
+         assert( aTileQueues[i].aTiles = (int*)malloc( tilesLength * sizeof(int) ));
+      }
+   }
+}
+
+
+/* behind tiles first, then most expensive first (longest processing time) */
+static int tileCompare( const void* pA, const void* pB )
+{
+   const int a = *(const int*)pA;
+   const int b = *(const int*)pB;
+
+   if( aTilePasses[a] != aTilePasses[b] )
+   {
+      return aTilePasses[a] < aTilePasses[b] ? -1 : +1;
+   }
+   if( aTileCosts[a] != aTileCosts[b] )
+   {
+      return aTileCosts[a] > aTileCosts[b] ? -1 : +1;
+   }
+   return a - b;
+}
+
+
+/* next tile for thread t: own queue first, then steal round the others */
+static int tileNext( const int t, const int threads )
+{
+   for( int i = 0;  i < threads;  ++i )
+   {
+      TileQueue* pQ = &aTileQueues[(t + i) % threads];
+      std::lock_guard<std::mutex> lk( pQ->lock );
+      if( pQ->head < pQ->tail )
+      {
+         return i ? pQ->aTiles[--pQ->tail] : pQ->aTiles[pQ->head++];
+      }
+   }
+   return -1;
+}
+
+
+/* direction of the ray through image plane point (sx, sy), in pixels of a
+   width x height image */
+static V3f cameraDirection
+(
+   const Camera* pC,
+   const double  tanView,
+   const double  sx,
+   const double  sy,
+   const int     width,
+   const int     height
+)
+{
+   /* make image plane XY displacement vector [-1,+1) coefficients */
+   const double cx = (( sx * 2.0 / width ) - 1.0) * tanView;
+   const double cy = (( sy * 2.0 / height ) - 1.0) * tanView * height / width;
+
+   /* make image plane offset vector,
+      by scaling the view definition by the coefficients */
+   const V3f rcx = pC->right * +cx;
+   const V3f ucy = pC->up    * -cy;
+   const V3f offset = rcx + ucy;
+
+   /* add image offset vector to view direction */
+   V3f sdv = pC->viewDirection + offset;
+   return sdv.normalized();
+}
+
+
+static void tileFrame
+(
+   const Camera*    pC,
+   const RayTracer* pRayTracer,
+   const int        tile,
+   const int        step,
+   Random*          pRandom
+)
+{
+   const double tanView = tan( pC->viewAngle * 0.5 );
+
+   const int x0 = tile % tilesX * CAMERA_TILE;
+   const int y0 = tile / tilesX * CAMERA_TILE;
+   const int x1 = x0 + CAMERA_TILE < W ? x0 + CAMERA_TILE : W;
+   const int y1 = y0 + CAMERA_TILE < H ? y0 + CAMERA_TILE : H;
+
+   V3f radiances[CAMERA_TILE * CAMERA_TILE];
+   V3f sampleDirections[CAMERA_TILE * CAMERA_TILE];
+   V3f hits[CAMERA_TILE * CAMERA_TILE];
+   int samplesLength = 0;
+
+   /* ray generation and tracing in separate passes, so hardware counters
+      can tell them apart */
+   {
+   PERFCTR( PERFCTR_RAYGEN );
+   for( int y=y0;  y<y1; y+=step )
+   {
+      for( int x=x0;  x<x1; x+=step )
+      {
+         /* make sample ray direction, stratified by pixels (or blocks),
+            with sub-pixel jitter */
+         const double sx = x + RandomReal64( pRandom ) * step;
+         const double sy = y + RandomReal64( pRandom ) * step;
+         sampleDirections[samplesLength++] =
+            cameraDirection( pC, tanView, sx, sy, W, H );
+      }
+   }
+   }
+
+   {
+   PERFCTR( PERFCTR_TRACE );
+   for( int i=0;  i<samplesLength; ++i )
+   {
+      /* get radiance from RayTracer */
+      radiances[i] = RayTracerRadiance( pRayTracer,
+         &pC->viewPosition, &sampleDirections[i], pRandom, 0, &hits[i] );
+   }
+   }
+
+   /* add radiance to image
+      upscale: each sample fills its block (hdr_accum clips at edges)
+      -- first hit is kept for reprojection, for sky its direction */
+   int i = 0;
+   for( int y=y0;  y<y1; y+=step )
+   {
+      for( int x=x0;  x<x1; x+=step, ++i )
+      {
+         const bool sky = !isfinite( hits[i].X() );
+         const V3f  hit = sky ? sampleDirections[i] : hits[i];
+         for( int by=0;  by<step; ++by )
+         {
+            for( int bx=0;  bx<step; ++bx ) hdr_accum(x+bx,y+by,radiances[i],hit,sky);
+         }
+      }
+   }
+}
+
+
+
+
 /* queries ------------------------------------------------------------------ */
 
+/**
+ * Accumulate one sample per pixel (or per block) to the image.<br/><br/>
+ *
+ * The image is cut in tiles, dealt to per thread queues with tiles left
+ * behind by cancelled frames first, then in order of their cost in the
+ * previous frame, most expensive first; idle threads steal from the others.
+ *
+ * @return false if cancelled through CameraFrameEpoch, tiles already done
+ * stay in the image
+ */
 // HEADERBEG
-void CameraFrame
+bool CameraFrame
 (
    const Camera* pC,
    const Scene*  pScene,
@@ -150,55 +387,139 @@ void CameraFrame
 )
 // HEADEREND
 {
-   const RayTracer rayTracer = RayTracerCreate( pScene );
+   const int step = CameraFrameStep > 1 ? CameraFrameStep : 1;
 
-   const double tanView = tan( pC->viewAngle * 0.5 );
+   const unsigned epoch = CameraFrameEpoch ? CameraFrameEpoch->load() : 0;
+
+   PROF( "CameraFrame" );
 
-#pragma omp parallel for
-   for( int y=0;  y<H; ++y )
+   const int threads = omp_get_max_threads();
+   tilesResize( threads );
+
+   /* tile order and random streams, serially */
+   for( int i = 0;  i < tilesLength;  ++i )
    {
-      V3f row[W];
-      float luma[W];
-      for( int x=0;  x<W; ++x )
+      aTileOrder[i] = i;
+      RandomSplit( &aTileRandoms[i], pRandom );
+   }
+   qsort( aTileOrder, tilesLength, sizeof(aTileOrder[0]), tileCompare );
+
+   bool complete = true;
+
+#pragma omp parallel num_threads( threads ) reduction( && : complete )
+   {
+   /* per thread, to show imbalance */
+   PROF( "CameraFrame tiles" );
+
+   const int t = omp_get_thread_num();
+   const int n = omp_get_num_threads();
+
+   /* NUMA mode: thread on a fixed node, tracing that node's replica */
+   numa_pin( t, n );
+   const RayTracer rayTracer = RayTracerCreate( numa_scene( pScene ) );
+
+   /* deal round the queues, each stays sorted */
+   {
+      TileQueue* pQ = &aTileQueues[t];
+      std::lock_guard<std::mutex> lk( pQ->lock );
+      pQ->head = pQ->tail = 0;
+      for( int i = t;  i < tilesLength;  i += n )
       {
-         /* make sample ray direction, stratified by pixels */
-         /* make image plane XY displacement vector [-1,+1) coefficients,
-            with sub-pixel jitter */
-         const double cx = (( (x + RandomReal64( pRandom )) * 2.0 / W ) - 1.0) * tanView;
-         const double cy = (( (y + RandomReal64( pRandom )) * 2.0 / H ) - 1.0) * tanView * H / W;
-
-         /* make image plane offset vector,
-            by scaling the view definition by the coefficients */
-         const V3f rcx = pC->right * +cx;
-         const V3f ucy = pC->up    * -cy;
-         const V3f offset = rcx + ucy;
-
-         /* add image offset vector to view direction */
-         V3f sdv = pC->viewDirection + offset;
-         const V3f sampleDirection = sdv.normalized();
-
-         /* get radiance from RayTracer */
-         V3f radiance = RayTracerRadiance( &rayTracer,
-            &pC->viewPosition, &sampleDirection, pRandom, 0 );
-
-         /* add radiance to image */
-         row[x]=radiance;
-         luma[x]=radiance.luma();
+         pQ->aTiles[pQ->tail++] = aTileOrder[i];
       }
+   }
+#pragma omp barrier
 
+   for( int tile;  (tile = tileNext( t, n )) >= 0; )
+   {
+      if( CameraFrameEpoch &&
+         CameraFrameEpoch->load( std::memory_order_relaxed ) != epoch )
+      {
+         complete = false;
+         continue;
+      }
 
-      for( int x=0;  x<W; ++x ) hdr_accum(x,y,row[x]);
+      const uint64_t t0 = prof_now();
+      tileFrame( pC, &rayTracer, tile, step, &aTileRandoms[tile] );
+      aTileCosts[tile] = prof_now() - t0;
+      ++aTilePasses[tile];
+   }
+   }
+
+   complete = complete && ( !CameraFrameEpoch || CameraFrameEpoch->load() == epoch );
+   if( complete )
+   {
+      memset( aTilePasses, 0, tilesLength * sizeof(aTilePasses[0]) );
+   }
+
+   return complete;
+}
+
+
+
+/**
+ * Render a rectangle of a bigger image to completion, without the image
+ * buffer: for images that do not fit in memory, done piece by piece.<br/><br/>
+ *
+ * Rows go to threads dynamically, each row with its own random stream split
+ * serially from pRandom, so the result does not depend on the threads.
+ *
+ * @aPixels_o width * height mean radiances, by rows
+ */
+// HEADERBEG
+void CameraRegion
+(
+   const Camera* pC,
+   const Scene*  pScene,
+   const int     imageWidth,
+   const int     imageHeight,
+   const int     x0,
+   const int     y0,
+   const int     width,
+   const int     height,
+   const int     samples,
+   Random*       pRandom,
+   V3f*          aPixels_o
+)
+// HEADEREND
+{
+   PROF( "CameraRegion" );
 
-//      // filtro quasi-mediano per fireflies
-//      // se il pixel centrale è troppo distante dalla media dei due limitrofi
-//      // scala la radianza
-//      hdr_accum(0,y,row[0]);
-//      for( int x=1;  x<W-1; ++x )
-//      {
-//         if( luma[x+0]/(luma[x-1]+luma[x+1]+1) < 2 ) hdr_accum(x,y,row[x]);
-//      }
-//      hdr_accum(W-1,y,row[W-1]);
+   const double tanView = tan( pC->viewAngle * 0.5 );
+
+   Random* aRowRandoms;
+   assert( aRowRandoms = (Random*)malloc( height * sizeof(Random) ));
+   for( int y = 0;  y < height;  ++y )
+   {
+      RandomSplit( &aRowRandoms[y], pRandom );
    }
+
+#pragma omp parallel
+   {
+   const RayTracer rayTracer = RayTracerCreate( pScene );
+
+#pragma omp for schedule( dynamic )
+   for( int y = 0;  y < height;  ++y )
+   {
+      Random* pR = &aRowRandoms[y];
+      for( int x = 0;  x < width;  ++x )
+      {
+         V3f sum = V3f::ZERO;
+         for( int s = 0;  s < samples;  ++s )
+         {
+            const double sx = x0 + x + RandomReal64( pR );
+            const double sy = y0 + y + RandomReal64( pR );
+            const V3f direction = cameraDirection( pC, tanView, sx, sy,
+               imageWidth, imageHeight );
+            sum = sum + RayTracerRadiance( &rayTracer, &pC->viewPosition,
+               &direction, pR, 0, 0 );
+         }
+         aPixels_o[y * width + x] = sum * (1.0f / samples);
+      }
+   }
+   }
+
+   free( aRowRandoms );
 }
 
 
@@ -214,3 +214,20 @@ double RandomReal64( Random* pR ) // HEADER
 {
    return pR->sId;
 }*/
+
+
+
+
+/**
+ * Seed a generator from another one, giving an independent stream.<br/><br/>
+ *
+ * Used for one stream per image tile, so threads do not share state.
+ */
+void RandomSplit( Random* pR, Random* pFrom )   // HEADER
+{
+   /* keep above the minimum seeds of 1, 7, 15 and 127 */
+   for( int i = 4;  i--; )
+   {
+      pR->state[i] = RandomInt32u( pFrom ) | 0x80u;
+   }
+}
@@ -11,6 +11,8 @@
 #include <SurfacePoint.h> // HEADER
 #include <Random.h>       // HEADER
 #include <Scene.h>        // HEADER
+#include <stats.h>
+#include <math.h>
 
 
 
@@ -79,6 +81,8 @@ static V3f sampleEmitters
          SurfacePointHitId( pSurfacePoint ), &pHitObject, &hitPosition );
 
       /* check if unshadowed */
+      STAT_ADD( shadow_rays, 1 );
+      STAT_ADD( shadow_occluded, pHitObject && (emitterId != pHitObject) );
       if( !pHitObject | emitterId == pHitObject )
       {
          /* get inward emission value */
@@ -119,6 +123,10 @@ RayTracer RayTracerCreate
 
 /* queries ------------------------------------------------------------------ */
 
+/**
+ * Radiance returned along a ray. pHitPosition_o (may be 0) receives where the
+ * ray first hit, or infinity if it hit nothing.
+ */
 // HEADERBEG
 V3f RayTracerRadiance
 (
@@ -126,7 +134,8 @@ V3f RayTracerRadiance
    const V3f* pRayOrigin,
    const V3f* pRayDirection,
    Random* pRandom,
-   const void* lastHit
+   const void* lastHit,
+   V3f* pHitPosition_o
 )
 // HEADEREND
 {
@@ -134,12 +143,21 @@ V3f RayTracerRadiance
 
    const V3f rayBackDirection = -*pRayDirection;
 
+   /* path length: first-hit starts a path */
+   STAT_PATH_NEXT( !lastHit );
+
    /* intersect ray with scene */
    const Triangle* pHitObject = 0;
    V3f hitPosition;
    SceneIntersection( pR->pScene, pRayOrigin, pRayDirection, lastHit,
       &pHitObject, &hitPosition );
 
+   if( pHitPosition_o )
+   {
+      *pHitPosition_o = pHitObject ? hitPosition :
+         V3f( INFINITY, INFINITY, INFINITY );
+   }
+
    if( pHitObject )
    {
       /* make surface point of intersection */
@@ -171,9 +189,13 @@ V3f RayTracerRadiance
             /* recurse */
             const V3f recursed = RayTracerRadiance( pR,
                &surfacePoint.position, &nextDirection, pRandom,
-               SurfacePointHitId( &surfacePoint ));
+               SurfacePointHitId( &surfacePoint ), 0 );
             recursedReflection = recursed.pointwise( color );
          }
+         else
+         {
+            STAT_PATH_END();
+         }
       }
 
       /* sum components */
@@ -183,6 +205,7 @@ V3f RayTracerRadiance
    else
    {
       /* no hit: default/background scene emission */
+      STAT_PATH_END();
       radiance = SceneDefaultEmission( pR->pScene, &rayBackDirection );
    }
 
@@ -9,13 +9,19 @@
 
 
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <assert.h>
 #include <obj_import.h>
+#include <prof.h>
+#include <stats.h>
+#include <huge.h>
 #include <stdint.h>       // HEADER
 #include <Triangle.h>     // HEADER
 #include <SpatialIndex.h> // HEADER
 #include <V3f.h>          // HEADER
+#include <M34.h>          // HEADER
+#include <Arena.h>        // HEADER
 
 
 
@@ -26,6 +32,14 @@
 // HEADEREND
 
 
+/* refitted index may cost this much more than the fresh one before it is
+   reconstructed */
+static const float REFIT_COST_LIMIT = 1.3;
+
+/* arena chunk for emitters and rest vertexs */
+static const size_t ARENA_CHUNK = 1 << 16;
+
+
 /**
  * Collection of objects in the environment.<br/><br/>
  *
@@ -35,6 +49,9 @@
  * * trianglesLength < MAX_TRIANGLES and >= 0
  * * emittersLength  < MAX_TRIANGLES and >= 0
  * * pIndex is not 0
+ * * indexCost is SpatialIndexCost( pIndex ) when last constructed
+ * * aRestVertexs is 0, or 3 * trianglesLength vertexs
+ * * dirtyFirst <= dirtyEnd <= trianglesLength (equal when none moved)
  * * skyEmission      >= 0
  * * groundReflection >= 0 and <= 1
  */
@@ -50,6 +67,17 @@ struct Scene
    int     emittersLength;
 
    SpatialIndex* pIndex;
+   float         indexCost;
+
+   /* vertexs as loaded, for SceneTransform() (made on first use) */
+   V3f*  aRestVertexs;
+
+   /* triangles moved since the index was last made or refitted */
+   int   dirtyFirst;
+   int   dirtyEnd;
+
+   /* storage of emitters and rest vertexs, freed together */
+   Arena arena;
 
    /* background */
    V3f   skyEmission;
@@ -63,6 +91,7 @@ typedef struct Scene Scene;
 
 
 Scene* tri_cb_ps;
+static int tri_cb_capacity;
 
 static TRI_CB_DEF(tri_cb){
    Triangle t;
@@ -87,16 +116,41 @@ static TRI_CB_DEF(tri_cb){
    t.emitivity.v[1] = e[1];
    t.emitivity.v[2] = e[2];
 
-   /* append to objects storage */
+   /* append to objects storage (growing geometrically) */
    assert( tri_cb_ps );
-   assert( tri_cb_ps->aTriangles = (Triangle*)realloc( tri_cb_ps->aTriangles, ++tri_cb_ps->trianglesLength * sizeof(Triangle)));
-   tri_cb_ps->aTriangles[tri_cb_ps->trianglesLength-1] = t;
+   if( tri_cb_ps->trianglesLength == tri_cb_capacity )
+   {
+      tri_cb_capacity = tri_cb_capacity ? tri_cb_capacity * 2 : 1024;
+      assert( tri_cb_ps->aTriangles = (Triangle*)realloc( tri_cb_ps->aTriangles, tri_cb_capacity * sizeof(Triangle)));
+   }
+   tri_cb_ps->aTriangles[tri_cb_ps->trianglesLength++] = t;
 }
 
 
 
 /* initialisation ----------------------------------------------------------- */
 
+/**
+ * (Re)make the index of objects, with the current SpatialIndex settings.
+ */
+// HEADERBEG
+void SceneIndex
+(
+   Scene*     pS,
+   const V3f* pEyePosition
+)
+// HEADEREND
+{
+   PROF( "SceneIndex" );
+   if( pS->pIndex ) SpatialIndexDestruct( pS->pIndex );
+   pS->pIndex = (SpatialIndex*)SpatialIndexConstruct( pEyePosition, pS->aTriangles, pS->trianglesLength );
+   pS->indexCost = SpatialIndexCost( pS->pIndex );
+   stats_index( pS->pIndex, pS->trianglesLength );
+   pS->dirtyFirst = pS->dirtyEnd = 0;
+}
+
+
+
 // HEADERBEG
 Scene* SceneConstruct
 (
@@ -113,34 +167,93 @@ Scene* SceneConstruct
    pS->skyEmission      = V3f( 0.0906, 0.0943, 0.1151 );
    pS->groundReflection = V3f( 0.1,    0.09,   0.07   );
 
-   assert( pS->aTriangles = (Triangle*)calloc( 0, sizeof(Triangle)) );
+   ArenaInit( &pS->arena, ARENA_CHUNK );
+
+   pS->aTriangles = 0;
    pS->trianglesLength = 0;
 
    tri_cb_ps = pS;
-   obj_import( wavefront_obj_path, tri_cb );
-
-   /* find emitting objects */
+   tri_cb_capacity = 0;
    {
-      int i;
+      PROF( "obj_import" );
+      obj_import( wavefront_obj_path, tri_cb );
+   }
 
-      assert( pS->apEmitters = (Triangle**)calloc( 0, sizeof(Triangle*)));
-      pS->emittersLength = 0;
+   /* trim (keep one slot, realloc to 0 would free) -- into huge pages, if
+      enabled and big enough */
+   pS->aTriangles = (Triangle*)huge_realloc( pS->aTriangles,
+      (pS->trianglesLength ? pS->trianglesLength : 1) * sizeof(Triangle), "triangoli" );
+
+   /* find emitting objects: count, then store */
+   {
+      int i, pass;
 
-      for( i = 0;  i < pS->trianglesLength;  ++i )
+      for( pass = 0;  pass < 2;  ++pass )
       {
-         /* has non-zero emission and area */
-         if( !pS->aTriangles[i].emitivity.is_zero() &&
-            (TriangleArea( &pS->aTriangles[i] ) > 0.0) )
+         if( pass )
+         {
+            pS->apEmitters = (Triangle**)ArenaAlloc( &pS->arena,
+               pS->emittersLength * sizeof(Triangle*) );
+         }
+         pS->emittersLength = 0;
+
+         for( i = 0;  i < pS->trianglesLength;  ++i )
          {
-            /* append to emitters storage */
-            assert( pS->apEmitters = (Triangle**)realloc( pS->apEmitters, ++pS->emittersLength * sizeof(Triangle*)));
-            pS->apEmitters[pS->emittersLength - 1] = &(pS->aTriangles[i]);
+            /* has non-zero emission and area */
+            if( !pS->aTriangles[i].emitivity.is_zero() &&
+               (TriangleArea( &pS->aTriangles[i] ) > 0.0) )
+            {
+               if( pass ) pS->apEmitters[pS->emittersLength] = &(pS->aTriangles[i]);
+               ++pS->emittersLength;
+            }
          }
       }
    }
 
    /* make index of objects */
-   pS->pIndex = (SpatialIndex*)SpatialIndexConstruct( pEyePosition, pS->aTriangles, pS->trianglesLength );
+   SceneIndex( pS, pEyePosition );
+   return pS;
+}
+
+
+/**
+ * Make a copy of the objects and their index, in memory first touched by the
+ * calling thread -- so a thread pinned to a NUMA node gets a node-local
+ * replica.<br/><br/>
+ *
+ * A replica does not follow later changes of its source (animation).
+ */
+// HEADERBEG
+Scene* SceneReplicate
+(
+   const Scene* pSource,
+   const V3f*   pEyePosition
+)
+// HEADEREND
+{
+   Scene* pS;
+   assert( pS = (Scene*)calloc( 1, sizeof(Scene)));
+   ArenaInit( &pS->arena, ARENA_CHUNK );
+
+   pS->skyEmission      = pSource->skyEmission;
+   pS->groundReflection = pSource->groundReflection;
+
+   /* objects: copying writes, so places, the pages */
+   pS->trianglesLength = pSource->trianglesLength;
+   pS->aTriangles = (Triangle*)huge_realloc( 0, (pS->trianglesLength + 1) * sizeof(Triangle),
+      "triangoli (replica)" );
+   memcpy( pS->aTriangles, pSource->aTriangles, pS->trianglesLength * sizeof(Triangle) );
+
+   /* emitters: same ones, pointing into the copy */
+   pS->emittersLength = pSource->emittersLength;
+   pS->apEmitters = (Triangle**)ArenaAlloc( &pS->arena, pS->emittersLength * sizeof(Triangle*) );
+   for( int i = 0;  i < pS->emittersLength;  ++i )
+   {
+      pS->apEmitters[i] = pS->aTriangles + (pSource->apEmitters[i] - pSource->aTriangles);
+   }
+
+   /* index: made afresh, it holds pointers to the objects */
+   SceneIndex( pS, pEyePosition );
    return pS;
 }
 
@@ -153,14 +266,143 @@ void SceneDestruct
 // HEADEREND
 {
    SpatialIndexDestruct( pS->pIndex );
-   free( pS->apEmitters );
-   free( pS->aTriangles );
+   ArenaFree( &pS->arena );
+   huge_free( pS->aTriangles );
    free( pS );
 }
 
 
 
 
+/* animation ---------------------------------------------------------------- */
+
+/* The render worker (render.cpp) traces pScene concurrently: callers must
+   hold render_pause() from the first change until SceneRefit() returns.
+   Replicas made by SceneReplicate() (NUMA mode) are separate copies and are
+   not moved or refitted -- animate with NUMA mode off, or replicate again.
+   bench -a drives these and checks them against a fresh index. */
+
+/* add triangles first..first+count-1 to the moved range (one span) */
+static void markDirty
+(
+   Scene*    pS,
+   const int first,
+   const int count
+)
+{
+   if( count == 0 ) return;
+   if( pS->dirtyFirst == pS->dirtyEnd )
+   {
+      pS->dirtyFirst = first;
+      pS->dirtyEnd   = first + count;
+   }
+   else
+   {
+      pS->dirtyFirst = first < pS->dirtyFirst ? first : pS->dirtyFirst;
+      pS->dirtyEnd   = first + count > pS->dirtyEnd ? first + count : pS->dirtyEnd;
+   }
+}
+
+
+/**
+ * Set new vertex positions for triangles first..first+count-1.
+ * Call SceneRefit() after the last change, before tracing.
+ */
+// HEADERBEG
+void SceneUpdateVertexs
+(
+   Scene*    pS,
+   int       first,
+   int       count,
+   const V3f aVertexs[][3]
+)
+// HEADEREND
+{
+   assert( (first >= 0) & (count >= 0) & (first + count <= pS->trianglesLength) );
+
+#pragma omp parallel for
+   for( int i = 0;  i < count;  ++i )
+   {
+      for( int v = 3;  v-- > 0; )
+      {
+         pS->aTriangles[first + i].aVertexs[v] = aVertexs[i][v];
+         if( pS->aRestVertexs ) pS->aRestVertexs[(first + i) * 3 + v] = aVertexs[i][v];
+      }
+   }
+   markDirty( pS, first, count );
+}
+
+
+/**
+ * Place triangles first..first+count-1 (a rigid instance) by a transform of
+ * their rest positions -- so repeated calls do not accumulate error.
+ * Call SceneRefit() after the last change, before tracing.
+ */
+// HEADERBEG
+void SceneTransform
+(
+   Scene* pS,
+   int    first,
+   int    count,
+   M34*   pTransform
+)
+// HEADEREND
+{
+   assert( (first >= 0) & (count >= 0) & (first + count <= pS->trianglesLength) );
+
+   /* keep rest positions on first use */
+   if( !pS->aRestVertexs )
+   {
+      pS->aRestVertexs = (V3f*)ArenaAlloc( &pS->arena, pS->trianglesLength * 3 * sizeof(V3f) );
+      for( int i = pS->trianglesLength;  i-- > 0; )
+      {
+         for( int v = 3;  v-- > 0;  pS->aRestVertexs[i * 3 + v] = pS->aTriangles[i].aVertexs[v] ) {}
+      }
+   }
+
+#pragma omp parallel for
+   for( int i = first;  i < first + count;  ++i )
+   {
+      for( int v = 3;  v-- > 0; )
+      {
+         pTransform->m_dot_v( pS->aTriangles[i].aVertexs[v].v, pS->aRestVertexs[i * 3 + v].v );
+      }
+   }
+   markDirty( pS, first, count );
+}
+
+
+/**
+ * Bring the index up to date after vertexs moved: refit the moved triangles
+ * in place (the others stay in their cells), or reconstruct it when it can
+ * no longer hold the triangles, or when refitting has made it too costly to
+ * trace.
+ *
+ * @return true if the index was reconstructed
+ */
+// HEADERBEG
+bool SceneRefit
+(
+   Scene*     pS,
+   const V3f* pEyePosition
+)
+// HEADEREND
+{
+   if( SpatialIndexRefit( pS->pIndex, pEyePosition, pS->aTriangles, pS->trianglesLength,
+          pS->dirtyFirst, pS->dirtyEnd - pS->dirtyFirst ) &&
+      (SpatialIndexCost( pS->pIndex ) <= pS->indexCost * REFIT_COST_LIMIT) )
+   {
+      pS->dirtyFirst = pS->dirtyEnd = 0;
+      return false;
+   }
+
+   SceneIndex( pS, pEyePosition );
+   return true;
+}
+
+
+
+
 /* queries ------------------------------------------------------------------ */
 
 // HEADERBEG
@@ -176,7 +418,7 @@ void SceneIntersection
 // HEADEREND
 {
    SpatialIndexIntersection( pS->pIndex, pRayOrigin, pRayDirection, lastHit,
-      0, ppHitObject_o, pHitPosition_o );
+      ppHitObject_o, pHitPosition_o );
 }
 
 
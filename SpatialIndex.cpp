@@ -9,11 +9,17 @@
 
 
 #include <stdlib.h>
-#include <stdint.h>
+#include <stdint.h>   // HEADER
 #include <float.h>
 #include <assert.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+#include <stats.h>
+#include <huge.h>
 
 #include <Triangle.h>   // HEADER
+#include <Arena.h>      // HEADER
 
 /**
  * A minimal spatial index for ray tracing.<br/><br/>
@@ -24,8 +30,8 @@
  * Constant.<br/><br/>
  *
  * @implementation
- * A crude State pattern: typed by isBranch field to be either a branch
- * or leaf cell.<br/><br/>
+ * A crude State pattern: typed by the top bit of a node's first word to be
+ * either a branch or leaf cell.<br/><br/>
  *
  * Octree: axis-aligned, cubical. Subcells are numbered thusly:
  * <pre>      110---111
@@ -35,7 +41,20 @@
  *    |/    |/    | /
  *    .-x  000---001      </pre><br/><br/>
  *
- * Each cell stores its bound (fatter data, but simpler code).<br/><br/>
+ * Only the root cell stores its bound: a subcell bound is exactly half its
+ * parent's, so it is remade while descending (zero bits per cell, and the
+ * same floats as when building). Cells are 8-byte nodes in one array, items
+ * are 4-byte triangle indexes in another:
+ * <pre>
+ *    branch: a = BRANCH | subcell mask   b = index of first subcell node
+ *    leaf:   a = items count             b = index of first item
+ *    lazy:   a = LAZY                    b = index of deferred subtree   </pre>
+ * The subcells present are stored together, in subcell number order.<br/><br/>
+ *
+ * Lazy construction (SpatialIndexLazyLevels > 0) makes only that many levels
+ * at a time: deeper branches become lazy cells, holding their items, and are
+ * made (as a separate index for that cell) by the first ray to reach them.
+ * Threads reaching one being made wait for it.<br/><br/>
  *
  * Calculations for building and tracing are absolute rather than incremental --
  * so quite numerically solid. Uses tolerances in: bounding triangles (in
@@ -45,22 +64,61 @@
  *
  * @invariants
  * * aBound[0-2] <= aBound[3-5]
- * * bound encompasses the cell's contents
- * if isBranch
- * * apArray elements are SpatialIndex pointers or zeros
- * * length (of apArray) is 8
+ * * bound encompasses the index's contents
+ * * aNodes[0] is the root cell
+ * if branch
+ * * subcell mask is not 0, except in dead nodes (unreachable, left by
+ *   SpatialIndexRefit)
+ * * b + (subcells count) <= nodesLength
+ * if lazy
+ * * b < deferredLength
  * else
- * * apArray elements are non-zero Triangle pointers
+ * * a + b <= itemsLength
+ * * aItems elements are < trianglesLength
  */
 
 
 // HEADERBEG
+struct SpatialIndexNode
+{
+   uint32_t a;
+   uint32_t b;
+};
+
+typedef struct SpatialIndexNode SpatialIndexNode;
+
+struct SpatialIndexDeferred
+{
+   /* 0 not made, 1 being made, 2 made */
+   int                  state;
+   struct SpatialIndex* pIndex;
+
+   /* cell contents, until made */
+   float                aBound[6];
+   int                  level;
+   uint32_t*            aItems;
+   int                  itemsLength;
+};
+
+typedef struct SpatialIndexDeferred SpatialIndexDeferred;
+
 struct SpatialIndex
 {
-   bool         isBranch;
-   float       aBound[6];
-   const void** apArray;
-   int      length;
+   float             aBound[6];
+
+   SpatialIndexNode* aNodes;
+   int               nodesLength;
+
+   uint32_t*         aItems;
+   int               itemsLength;
+
+   SpatialIndexDeferred* aDeferred;
+   int                   deferredLength;
+
+   /* lazy cells' items */
+   Arena             arena;
+
+   const Triangle*   aTriangles;
 };
 
 typedef struct SpatialIndex SpatialIndex;
@@ -69,234 +127,541 @@ typedef struct SpatialIndex SpatialIndex;
 
 /* constants ---------------------------------------------------------------- */
 
+/* relative costs for the surface area heuristic (only the ratio matters) */
+static const float SAH_TRAVERSAL = 1.0;
+static const float SAH_INTERSECT = 1.5;
+
+/* node first word */
+static const uint32_t BRANCH = 0x80000000u;
+static const uint32_t LAZY   = 0x40000000u;
+
+/* SpatialIndexTune() sweep, and sample rays traced for each setting (best
+   of some repeats, against timing noise) */
+static const int TUNE_MAX_ITEMS[]  = { 2, 4, 6, 8, 12, 16, 24, 32 };
+static const int TUNE_MAX_LEVELS[] = { 16, 24, 32, 44 };
+static const int TUNE_RAYS         = 1 << 18;
+static const int TUNE_REPEATS      = 3;
+
+/* root cell margin on each side, as a fraction of the contents' size: room
+   for animated items to move before the index must be reconstructed */
+static const float ROOT_SLACK = 1.0 / 16.0;
+
+/* arena chunk for construction scratch and lazy cells' items */
+static const size_t ARENA_CHUNK = 1 << 16;
+
+
+
+
+/* options ------------------------------------------------------------------ */
+
+// HEADERBEG
+extern int SpatialIndexMaxLevels;
+extern int SpatialIndexMaxItems;
+// HEADEREND
+
 /* accommodates scene including sun and earth, down to cm cells
    (use 47 for mm) */
-static const int MAX_LEVELS = 44;
+int SpatialIndexMaxLevels = 44;
 
-/* 8 seemed reasonably optimal in casual testing */
-static const int MAX_ITEMS  =  8;
+/* 8 seemed reasonably optimal in casual testing (SpatialIndexTune() finds
+   the best for a scene) */
+int SpatialIndexMaxItems  =  8;
+
+/* levels made per visit, with lazy construction (0: make all up front) */
+int SpatialIndexLazyLevels;   // HEADER
 
 
 
 
 /* implementation ----------------------------------------------------------- */
 
+#define isBranch( pN )  ((pN)->a & BRANCH)
+#define isLazy( pN )    ((pN)->a & LAZY)
+#define subCellNode( pS, pN, s ) (&(pS)->aNodes[(pN)->b + \
+   __builtin_popcount( (pN)->a & ((1u << (s)) - 1u) )])
+
+
+/**
+ * Bound of subcell s of a cell (see numbering above).
+ */
+static void subCellBound
+(
+   const float aBound[6],
+   const int   s,
+   float       aSubBound_o[6]
+)
+{
+   int j, d, m;
+   for( j = 0, d = 0, m = 0;  j < 6;  ++j, d = j / 3, m = j % 3 )
+   {
+      aSubBound_o[j] = ((s >> m) & 1) ^ d ? (aBound[m] + aBound[m + 3]) * 0.5 :
+         aBound[j];
+   }
+}
+
+
+/**
+ * Item bound overlaps cell bound (must overlap in all dimensions).
+ */
+static bool isOverlap
+(
+   const float aItemBound[6],
+   const float aCellBound[6]
+)
+{
+   int j, d, m;
+   bool is = true;
+   for( j = 0, d = 0, m = 0;  j < 6;  ++j, d = j / 3, m = j % 3 )
+   {
+      is &= (aItemBound[(d ^ 1) * 3 + m] >= aCellBound[j]) ^ d;
+   }
+   return is;
+}
+
+
+/**
+ * Append count nodes, or items, to the index stores (growing geometrically).
+ *
+ * @return index of the first appended
+ */
+static int appendNodes
+(
+   SpatialIndex* pS,
+   int*          pCapacity,
+   const int     count
+)
+{
+   if( pS->nodesLength + count > *pCapacity )
+   {
+      *pCapacity = (pS->nodesLength + count) * 2;
+      assert( pS->aNodes = (SpatialIndexNode*)realloc( pS->aNodes,
+         *pCapacity * sizeof(SpatialIndexNode)));
+   }
+   pS->nodesLength += count;
+   return pS->nodesLength - count;
+}
+
+static int appendDeferred
+(
+   SpatialIndex* pS,
+   int*          pCapacity
+)
+{
+   if( pS->deferredLength + 1 > *pCapacity )
+   {
+      *pCapacity = (pS->deferredLength + 1) * 2;
+      assert( pS->aDeferred = (SpatialIndexDeferred*)realloc( pS->aDeferred,
+         *pCapacity * sizeof(SpatialIndexDeferred)));
+   }
+   return pS->deferredLength++;
+}
+
+static int appendItems
+(
+   SpatialIndex* pS,
+   int*          pCapacity,
+   const int     count
+)
+{
+   if( pS->itemsLength + count > *pCapacity )
+   {
+      *pCapacity = (pS->itemsLength + count) * 2;
+      assert( pS->aItems = (uint32_t*)realloc( pS->aItems,
+         *pCapacity * sizeof(uint32_t)));
+   }
+   pS->itemsLength += count;
+   return pS->itemsLength - count;
+}
+
+
 static void construct
 (
-   Triangle** apItems,
-   const int      itemsLength,
-   const int      level,
-   SpatialIndex*    pS_o
+   SpatialIndex*   pS,
+   Arena*          pScratch,
+   int             aCapacity[3],
+   const uint32_t* aItems,
+   const int       itemsLength,
+   const int       level,
+   const int       node,
+   const float     aBound[6],
+   const int       levelsLeft
 )
 {
    /* is branch if items overflow leaf and tree not too deep */
-   pS_o->isBranch = (itemsLength > MAX_ITEMS) & (level < (MAX_LEVELS - 1));
+   const bool isBranch = (itemsLength > SpatialIndexMaxItems) &
+      (level < (SpatialIndexMaxLevels - 1));
 
-   /* make branch: make sub-cells, and recurse construction */
-   if( pS_o->isBranch )
+   /* make lazy: keep items, to make the branch when first visited */
+   if( isBranch & (levelsLeft == 0) )
    {
-      int s, q;
+      const int d = appendDeferred( pS, &aCapacity[2] );
+      SpatialIndexDeferred* pD = &pS->aDeferred[d];
+      int i;
 
-      /* make subcells */
-      pS_o->length  = 8;
-      assert( pS_o->apArray = (const void**)calloc( pS_o->length, sizeof(const void*)));
-      for( s = pS_o->length, q = 0;  s-- > 0; )
-      {
-         float aSubBound[6];
-         int  subItemsLength = 0;
-         Triangle** apSubItems;
-         assert( apSubItems = (Triangle**)calloc( subItemsLength, sizeof(Triangle*)));
+      pD->state       = 0;
+      pD->pIndex      = 0;
+      pD->level       = level;
+      pD->itemsLength = itemsLength;
+      for( i = 6;  i-- > 0;  pD->aBound[i] = aBound[i] ) {}
+      pD->aItems = (uint32_t*)ArenaAlloc( &pS->arena, itemsLength * sizeof(uint32_t) );
+      for( i = itemsLength;  i-- > 0;  pD->aItems[i] = aItems[i] ) {}
 
-         int j, d, m, i;
+      pS->aNodes[node].a = LAZY;
+      pS->aNodes[node].b = d;
+   }
+   /* make branch: make sub-cells, and recurse construction */
+   else if( isBranch )
+   {
+      float    aaSubBound[8][6];
+      int      aSubItemsLength[8] = { 0 };
+      int      aNextLevel[8];
+      uint8_t* aOverlaps;
+      uint32_t mask = 0;
+      int      s, q, i, first;
+
+      /* scratch space, given back in stack order */
+      const ArenaMark mark = ArenaGetMark( pScratch );
+
+      /* note which subcells each item overlaps (bounding each item once) */
+      for( s = 8;  s-- > 0;  subCellBound( aBound, s, aaSubBound[s] ) ) {}
+
+      aOverlaps = (uint8_t*)ArenaAlloc( pScratch, itemsLength );
+      memset( aOverlaps, 0, itemsLength );
+      for( i = itemsLength;  i-- > 0; )
+      {
+         float aItemBound[6];
+         TriangleBound( &pS->aTriangles[aItems[i]], aItemBound );
 
-         /* make subcell bound */
-         for( j = 0, d = 0, m = 0;  j < 6;  ++j, d = j / 3, m = j % 3 )
+         for( s = 8;  s-- > 0; )
          {
-            aSubBound[j] = ((s >> m) & 1) ^ d ? (pS_o->aBound[m] +
-               pS_o->aBound[m + 3]) * 0.5 : pS_o->aBound[j];
+            if( isOverlap( aItemBound, aaSubBound[s] ) )
+            {
+               aOverlaps[i] |= 1 << s;
+               ++aSubItemsLength[s];
+            }
          }
+      }
 
-         /* collect items that overlap subcell */
-         for( i = itemsLength;  i-- > 0; )
-         {
-            int isOverlap = 1;
+      /* make subcells, if any overlapping subitems */
+      for( s = 8, q = 0;  s-- > 0; )
+      {
+         q += aSubItemsLength[s] == itemsLength ? 1 : 0;
 
-            /* must overlap in all dimensions */
-            float aItemBound[6];
-            TriangleBound( apItems[i], aItemBound );
-            for( j = 0, d = 0, m = 0;  j < 6;  ++j, d = j / 3, m = j % 3 )
-            {
-               isOverlap &= (aItemBound[(d ^ 1) * 3 + m] >= aSubBound[j]) ^ d;
-            }
+         /* curtail degenerate subdivision by adjusting next level
+            (degenerate if two or more subcells copy entire contents of
+            parent, or if subdivision reaches below mm size)
+            (having a model including the sun requires one subcell copying
+            entire contents of parent to be allowed) */
+         aNextLevel[s] = (q > 1) | ((aaSubBound[s][3] - aaSubBound[s][0]) <
+            (TOLERANCE * 4.0)) ? SpatialIndexMaxLevels : level + 1;
+
+         mask |= (aSubItemsLength[s] > 0) << s;
+      }
+
+      first = appendNodes( pS, &aCapacity[0], __builtin_popcount( mask ));
+      pS->aNodes[node].a = BRANCH | mask;
+      pS->aNodes[node].b = first;
+
+      /* collect subitems and recurse */
+      const ArenaMark subMark = ArenaGetMark( pScratch );
+      for( s = 8;  s-- > 0; )
+      {
+         if( aSubItemsLength[s] > 0 )
+         {
+            uint32_t* aSubItems = (uint32_t*)ArenaAlloc( pScratch,
+               aSubItemsLength[s] * sizeof(uint32_t) );
+            int       subItemsLength = 0;
 
-            /* maybe append to subitems store */
-            if( isOverlap )
+            for( i = itemsLength;  i-- > 0; )
             {
-               assert( apSubItems = (Triangle**)realloc( (Triangle**)apSubItems, ++subItemsLength * sizeof(Triangle*)));
-               apSubItems[subItemsLength - 1] = (Triangle*)apItems[i];
+               if( (aOverlaps[i] >> s) & 1 ) aSubItems[subItemsLength++] = aItems[i];
             }
-         }
 
-         q += subItemsLength == itemsLength ? 1 : 0;
+            construct( pS, pScratch, aCapacity, aSubItems, subItemsLength,
+               aNextLevel[s], first + __builtin_popcount( mask & ((1u << s) - 1u) ),
+               aaSubBound[s], levelsLeft - 1 );
 
-         /* maybe make subcell, if any overlapping subitems */
-         if( subItemsLength > 0 )
-         {
-            SpatialIndex* pS;
-            assert( pS = (SpatialIndex*)calloc( 1, sizeof(SpatialIndex)));
-            /* curtail degenerate subdivision by adjusting next level
-               (degenerate if two or more subcells copy entire contents of
-               parent, or if subdivision reaches below mm size)
-               (having a model including the sun requires one subcell copying
-               entire contents of parent to be allowed) */
-            const int nextLevel = (q > 1) | ((aSubBound[3] - aSubBound[0]) <
-               (TOLERANCE * 4.0)) ? MAX_LEVELS : level + 1;
-
-            pS_o->apArray[s] = pS;
-            for( i = 6;  i-- > 0;  pS->aBound[i] = aSubBound[i] ) {}
-
-            /* recurse */
-            construct( apSubItems, subItemsLength, nextLevel, pS );
+            ArenaReset( pScratch, subMark );
          }
-
-         free( (Triangle**)apSubItems );
       }
+
+      ArenaReset( pScratch, mark );
    }
    /* make leaf: store items, and end recursion */
    else
    {
+      const int first = appendItems( pS, &aCapacity[1], itemsLength );
       int i;
 
-      /* alloc */
-      pS_o->length  = itemsLength;
-      assert( pS_o->apArray = (const void**)calloc( pS_o->length, sizeof(const void*)));
+      pS->aNodes[node].a = itemsLength;
+      pS->aNodes[node].b = first;
 
       /* copy */
-      for( i = pS_o->length;  i-- > 0;  pS_o->apArray[i] = apItems[i] ) {}
+      for( i = itemsLength;  i-- > 0;  pS->aItems[first + i] = aItems[i] ) {}
    }
 }
 
 
-
-
-/* initialisation ----------------------------------------------------------- */
-
-// HEADERBEG
-const SpatialIndex* SpatialIndexConstruct
+/**
+ * Make an index of the items in a cell, from the given level down.
+ */
+static SpatialIndex* make
 (
-   const V3f* pEyePosition,
-   const Triangle* aItems,
-   int           itemsLength
+   const Triangle* aTriangles,
+   const uint32_t* aItems,
+   const int       itemsLength,
+   const int       level,
+   const float     aBound[6]
 )
-// HEADEREND
 {
    SpatialIndex* pS;
+   int aCapacity[3] = { 0, 0, 0 }, i;
    assert( pS = (SpatialIndex*)calloc( 1, sizeof(SpatialIndex)));
+   pS->aTriangles = aTriangles;
+   for( i = 6;  i-- > 0;  pS->aBound[i] = aBound[i] ) {}
+   ArenaInit( &pS->arena, ARENA_CHUNK );
 
-   /* set overall bound (and convert to collection of pointers) */
-   Triangle** apItems;
-   assert( apItems = (Triangle**)calloc( itemsLength, sizeof(Triangle*)));
-   
+   /* subitem lists of the whole recursion fit in a few chunks */
+   Arena scratch;
+   ArenaInit( &scratch, ARENA_CHUNK );
+
+   /* make subcell tree */
+   appendNodes( pS, &aCapacity[0], 1 );
+   construct( pS, &scratch, aCapacity, aItems, itemsLength, level, 0, pS->aBound,
+      SpatialIndexLazyLevels > 0 ? SpatialIndexLazyLevels : -1 );
+
+   ArenaFree( &scratch );
+
+   /* trim stores (keep at least one slot, realloc to 0 would free) -- the
+      big ones into huge pages, if enabled */
+   pS->aNodes = (SpatialIndexNode*)huge_realloc( pS->aNodes,
+      pS->nodesLength * sizeof(SpatialIndexNode), "nodi indice" );
+   pS->aItems = (uint32_t*)huge_realloc( pS->aItems,
+      (pS->itemsLength ? pS->itemsLength : 1) * sizeof(uint32_t), "elementi indice" );
+   if( pS->aDeferred )
    {
-      int i, j;
+      assert( pS->aDeferred = (SpatialIndexDeferred*)realloc( pS->aDeferred,
+         pS->deferredLength * sizeof(SpatialIndexDeferred)));
+   }
 
-      /* accommodate eye position (makes tracing algorithm simpler) */
-      for( i = 6;  i-- > 0;  pS->aBound[i] = pEyePosition->v[i % 3] ) {}
+   return pS;
+}
 
-      /* accommodate all items */
-      for( i = itemsLength;  i-- > 0;  apItems[i] = (Triangle*)&aItems[i] )
-      {
-         float aItemBound[6];
-         TriangleBound( &aItems[i], aItemBound );
 
-         /* accommodate item */
-         for( j = 0;  j < 6;  ++j )
+/**
+ * The index of a lazy cell, made by the first caller (others wait for it).
+ */
+static const SpatialIndex* deferred
+(
+   const SpatialIndex* pS,
+   const int           d
+)
+{
+   SpatialIndexDeferred* pD = &pS->aDeferred[d];
+
+   if( __atomic_load_n( &pD->state, __ATOMIC_ACQUIRE ) != 2 )
+   {
+      int notMade = 0;
+      if( __atomic_compare_exchange_n( &pD->state, &notMade, 1, false,
+         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED ) )
+      {
+         pD->pIndex = make( pS->aTriangles, pD->aItems, pD->itemsLength,
+            pD->level, pD->aBound );
+         /* items stay in the arena until destruction */
+         pD->aItems = 0;
+         __atomic_store_n( &pD->state, 2, __ATOMIC_RELEASE );
+      }
+      else
+      {
+         while( __atomic_load_n( &pD->state, __ATOMIC_ACQUIRE ) != 2 )
          {
-            if( (pS->aBound[j] > aItemBound[j]) ^ (j > 2) )
-            {
-               pS->aBound[j] = aItemBound[j];
-            }
+            sched_yield();
          }
       }
+   }
 
-      /* make cubical */
+   return pD->pIndex;
+}
+
+
+/**
+ * Append count nodes when refitting: the store is trimmed (maybe into huge
+ * pages) after construction, so regrown with huge_realloc.
+ *
+ * @return index of the first appended
+ */
+static int appendRefitNodes
+(
+   SpatialIndex* pS,
+   int*          pCapacity,
+   const int     count
+)
+{
+   if( pS->nodesLength + count > *pCapacity )
+   {
+      *pCapacity = (pS->nodesLength + count) * 2;
+      pS->aNodes = (SpatialIndexNode*)huge_realloc( pS->aNodes,
+         *pCapacity * sizeof(SpatialIndexNode), "nodi indice" );
+   }
+   pS->nodesLength += count;
+   return pS->nodesLength - count;
+}
+
+
+/**
+ * Make, as empty leaves, the subcells an item overlaps that were never made,
+ * down the existing cell tree. Serial: nodes move (by index, not pointer).
+ * <br/><br/>
+ *
+ * A branch's subcells are stored together, so one more goes in a new block
+ * at the end; the old block is left dead, as empty branches (never reached,
+ * nor counted as leaves). A branch grows at most to 8 subcells, so this is
+ * bounded however long the animation.
+ */
+static void growCells
+(
+   SpatialIndex* pS,
+   int*          pCapacity,
+   const int     node,
+   const float   aBound[6],
+   const float   aItemBound[6]
+)
+{
+   int s;
+   if( !isBranch( &pS->aNodes[node] ) ) return;
+
+   for( s = 8;  s-- > 0; )
+   {
+      float aSubBound[6];
+      subCellBound( aBound, s, aSubBound );
+      if( !isOverlap( aItemBound, aSubBound ) ) continue;
+
+      if( !((pS->aNodes[node].a >> s) & 1) )
       {
-         float maxSize = 0.0, *b = 0;
-         /* find max dimension */
-         for( b = pS->aBound + 3;  b-- > pS->aBound; )
+         const uint32_t mask  = pS->aNodes[node].a & ~BRANCH;
+         const int      old   = pS->aNodes[node].b;
+         const int      first = appendRefitNodes( pS, pCapacity,
+            __builtin_popcount( mask ) + 1 );
+         int t, j;
+
+         for( t = 0, j = 0;  t < 8;  ++t )
          {
-            if( maxSize < (b[3] - b[0]) ) maxSize = b[3] - b[0];
+            if( t == s )
+            {
+               pS->aNodes[first + j].a = 0;
+               pS->aNodes[first + j].b = 0;
+               ++j;
+            }
+            else if( (mask >> t) & 1 )
+            {
+               pS->aNodes[first + j++] = pS->aNodes[old + __builtin_popcount(
+                  mask & ((1u << t) - 1u) )];
+            }
          }
-         /* set all dimensions to max */
-         for( b = pS->aBound + 3;  b-- > pS->aBound; )
+         for( t = __builtin_popcount( mask );  t-- > 0; )
          {
-            if( b[3] < (b[0] + maxSize) ) b[3] = b[0] + maxSize;
+            pS->aNodes[old + t].a = BRANCH;
+            pS->aNodes[old + t].b = 0;
          }
-      }
-   }
-
-   /* make subcell tree */
-   construct( apItems, itemsLength, 0, pS );
 
-   free( (Triangle**)apItems );
+         pS->aNodes[node].a = BRANCH | mask | (1u << s);
+         pS->aNodes[node].b = first;
+      }
 
-   return pS;
+      growCells( pS, pCapacity, subCellNode( pS, &pS->aNodes[node], s ) -
+         pS->aNodes, aSubBound, aItemBound );
+   }
 }
 
 
-// HEADERBEG
-void SpatialIndexDestruct
+/**
+ * Route one moved item down the cell tree (all its subcells made), counting
+ * it into (aNewItems 0) or storing it in every leaf it overlaps. aCounts is
+ * per node: the leaf's new count, then its fill cursor.
+ */
+static void refitItem
 (
-   SpatialIndex* pS
+   const SpatialIndex*     pS,
+   const SpatialIndexNode* pN,
+   const float             aBound[6],
+   const uint32_t          item,
+   const float             aItemBound[6],
+   uint32_t*               aCounts,
+   const uint32_t*         aFirsts,
+   uint32_t*               aNewItems
 )
-// HEADEREND
 {
-   /* recurse through branch subcells */
-   int i;
-   for( i = pS->length;  pS->isBranch & (i-- > 0); )
+   if( isBranch( pN ) )
    {
-      if( pS->apArray[i] )
+      int s;
+      for( s = 8;  s-- > 0; )
       {
-         SpatialIndexDestruct( (SpatialIndex*)pS->apArray[i] );
+         float aSubBound[6];
+         subCellBound( aBound, s, aSubBound );
+         if( isOverlap( aItemBound, aSubBound ) )
+         {
+            refitItem( pS, subCellNode( pS, pN, s ), aSubBound, item,
+               aItemBound, aCounts, aFirsts, aNewItems );
+         }
       }
+      return;
    }
 
-   free( (void**)pS->apArray );
-
-   free( pS );
+   {
+      const int      node = pN - pS->aNodes;
+      const uint32_t i    = __atomic_fetch_add( &aCounts[node], 1, __ATOMIC_RELAXED );
+      if( aNewItems ) aNewItems[aFirsts[node] + i] = item;
+   }
 }
 
 
+static float cost
+(
+   const SpatialIndex*     pS,
+   const SpatialIndexNode* pN,
+   const float             side
+)
+{
+   /* cells are cubical, so surface area goes with the square of the side */
+   float c = side * side * (isBranch( pN ) ? SAH_TRAVERSAL :
+      SAH_INTERSECT * (isLazy( pN ) ? pS->aDeferred[pN->b].itemsLength : pN->a));
+
+   int s;
+   for( s = 8;  isBranch( pN ) && (s-- > 0); )
+   {
+      if( (pN->a >> s) & 1 ) c += cost( pS, subCellNode( pS, pN, s ), side * 0.5 );
+   }
 
+   return c;
+}
 
-/* queries ------------------------------------------------------------------ */
 
-// HEADERBEG
-void SpatialIndexIntersection
+static void intersect
 (
-   const SpatialIndex* pS,
-   const V3f*     pRayOrigin,
-   const V3f*     pRayDirection,
-   const void*         lastHit,
-   const V3f*     pStart,
-   const Triangle**    ppHitObject_o,
-   V3f*           pHitPosition_o
+   const SpatialIndex*     pS,
+   const SpatialIndexNode* pN,
+   const float             aBound[6],
+   const V3f*              pRayOrigin,
+   const V3f*              pRayDirection,
+   const void*             lastHit,
+   const V3f*              pStart,
+   const Triangle**        ppHitObject_o,
+   V3f*                    pHitPosition_o
 )
-// HEADEREND
 {
+   STAT_ADD( nodes, 1 );
+
    /* is branch: step through subcells and recurse */
-   if( pS->isBranch )
+   if( isBranch( pN ) )
    {
       int subCell, i;
       V3f cellPosition;
 
-      pStart = pStart ? pStart : pRayOrigin;
-
       /* find which subcell holds ray origin (ray origin is inside cell) */
       for( subCell = 0, i = 0;  i<3; ++i )
       {
          /* compare dimension with center */
-         subCell |= (pStart->v[i] >= ((pS->aBound[i] + pS->aBound[i+3]) * 0.5)) << i;
+         subCell |= (pStart->v[i] >= ((aBound[i] + aBound[i+3]) * 0.5)) << i;
       }
 
       /* step through intersected subcells */
@@ -305,12 +670,15 @@ void SpatialIndexIntersection
          int axis = 2, i;
          float step[3];
 
-         if( pS->apArray[subCell] )
+         if( (pN->a >> subCell) & 1 )
          {
+            float aSubBound[6];
+            subCellBound( aBound, subCell, aSubBound );
+
             /* intersect subcell (by recursing) */
-            SpatialIndexIntersection( (const SpatialIndex*)
-               pS->apArray[subCell], pRayOrigin, pRayDirection, lastHit,
-               &cellPosition, ppHitObject_o, pHitPosition_o );
+            intersect( pS, subCellNode( pS, pN, subCell ), aSubBound,
+               pRayOrigin, pRayDirection, lastHit, &cellPosition,
+               ppHitObject_o, pHitPosition_o );
 
             /* exit branch (this function) if item hit */
             if( *ppHitObject_o )
@@ -327,8 +695,8 @@ void SpatialIndexIntersection
                dimension) */
             const bool   high = (subCell >> i) & 1;
             const float face = (pRayDirection->v[i] < 0.0) ^ high ?
-               pS->aBound[i + (high * 3)] :
-               (pS->aBound[i] + pS->aBound[i + 3]) * 0.5;
+               aBound[i + (high * 3)] :
+               (aBound[i] + aBound[i + 3]) * 0.5;
 
             /* calculate distance to face
                (div by zero produces infinity, which is later discarded) */
@@ -354,6 +722,13 @@ void SpatialIndexIntersection
          }
       }
    }
+   /* is lazy: intersect its index (made now, if first visit) */
+   else if( isLazy( pN ) )
+   {
+      const SpatialIndex* pL = deferred( pS, pN->b );
+      intersect( pL, &pL->aNodes[0], pL->aBound, pRayOrigin, pRayDirection,
+         lastHit, pStart, ppHitObject_o, pHitPosition_o );
+   }
    /* is leaf: exhaustively intersect contained items */
    else
    {
@@ -363,27 +738,28 @@ void SpatialIndexIntersection
       *ppHitObject_o = 0;
 
       /* step through items */
-      for( i = pS->length;  i-- > 0; )
+      for( i = pN->a;  i-- > 0; )
       {
-         const Triangle* pItem = (const Triangle*)(pS->apArray[i]);
+         const Triangle* pItem = &pS->aTriangles[pS->aItems[pN->b + i]];
 
          /* avoid spurious intersection with surface just come from */
          if( pItem != lastHit )
          {
             /* intersect ray with item, and inspect if nearest so far */
             float distance = DBL_MAX;
+            STAT_ADD( triangles, 1 );
             if( TriangleIntersection( pItem, pRayOrigin, pRayDirection,
                &distance ) && (distance < nearestDistance) )
             {
                /* check intersection is inside cell bound (with tolerance) */
                const V3f ray = *pRayDirection * distance;
                const V3f hit = *pRayOrigin + ray;
-               if( (pS->aBound[0] - hit.X() <= TOLERANCE) &
-                   (hit.X() - pS->aBound[3] <= TOLERANCE) &
-                   (pS->aBound[1] - hit.Y() <= TOLERANCE) &
-                   (hit.Y() - pS->aBound[4] <= TOLERANCE) &
-                   (pS->aBound[2] - hit.Z() <= TOLERANCE) &
-                   (hit.Z() - pS->aBound[5] <= TOLERANCE) )
+               if( (aBound[0] - hit.X() <= TOLERANCE) &
+                   (hit.X() - aBound[3] <= TOLERANCE) &
+                   (aBound[1] - hit.Y() <= TOLERANCE) &
+                   (hit.Y() - aBound[4] <= TOLERANCE) &
+                   (aBound[2] - hit.Z() <= TOLERANCE) &
+                   (hit.Z() - aBound[5] <= TOLERANCE) )
                {
                   /* note nearest so far */
                   *ppHitObject_o  = pItem;
@@ -395,3 +771,515 @@ void SpatialIndexIntersection
       }
    }
 }
+
+
+
+
+/* initialisation ----------------------------------------------------------- */
+
+// HEADERBEG
+const SpatialIndex* SpatialIndexConstruct
+(
+   const V3f* pEyePosition,
+   const Triangle* aItems,
+   int           itemsLength
+)
+// HEADEREND
+{
+   SpatialIndex* pS;
+   float aBound[6];
+
+   /* set overall bound (and convert to collection of indexes) */
+   uint32_t* aAllItems;
+   assert( aAllItems = (uint32_t*)calloc( itemsLength, sizeof(uint32_t)));
+
+   {
+      int i, j;
+
+      /* accommodate eye position (makes tracing algorithm simpler) */
+      for( i = 6;  i-- > 0;  aBound[i] = pEyePosition->v[i % 3] ) {}
+
+      /* accommodate all items */
+      for( i = itemsLength;  i-- > 0;  aAllItems[i] = i )
+      {
+         float aItemBound[6];
+         TriangleBound( &aItems[i], aItemBound );
+
+         /* accommodate item */
+         for( j = 0;  j < 6;  ++j )
+         {
+            if( (aBound[j] > aItemBound[j]) ^ (j > 2) )
+            {
+               aBound[j] = aItemBound[j];
+            }
+         }
+      }
+
+      /* make cubical */
+      {
+         float maxSize = 0.0, *b = 0;
+         /* find max dimension */
+         for( b = aBound + 3;  b-- > aBound; )
+         {
+            if( maxSize < (b[3] - b[0]) ) maxSize = b[3] - b[0];
+         }
+         /* set all dimensions to max */
+         for( b = aBound + 3;  b-- > aBound; )
+         {
+            if( b[3] < (b[0] + maxSize) ) b[3] = b[0] + maxSize;
+         }
+         /* widen by the slack */
+         for( b = aBound + 3;  b-- > aBound; )
+         {
+            b[0] -= maxSize * ROOT_SLACK;
+            b[3] += maxSize * ROOT_SLACK;
+         }
+      }
+   }
+
+   /* make subcell tree */
+   pS = make( aItems, aAllItems, itemsLength, 0, aBound );
+
+   free( aAllItems );
+
+   return pS;
+}
+
+
+// HEADERBEG
+void SpatialIndexDestruct
+(
+   SpatialIndex* pS
+)
+// HEADEREND
+{
+   int i;
+   for( i = pS->deferredLength;  i-- > 0; )
+   {
+      if( pS->aDeferred[i].pIndex ) SpatialIndexDestruct( pS->aDeferred[i].pIndex );
+   }
+
+   ArenaFree( &pS->arena );
+   free( pS->aDeferred );
+   huge_free( pS->aItems );
+   huge_free( pS->aNodes );
+   free( pS );
+}
+
+
+/**
+ * Move items first..first+count-1 to the cells they now overlap, keeping the
+ * rest where they are. Cells they reach that were never made are added as
+ * leaves; the tree is otherwise unchanged. O(moved * depth) routing plus one
+ * linear pass over the leaves' item lists (to drop the moved items' old
+ * references and lay the lists out again), parallel.<br/><br/>
+ *
+ * aItems must be the same array (same order and length) the index was
+ * constructed from; only items first..first+count-1 may have moved.
+ *
+ * @return false if the tree cannot hold the items any more (a moved item, or
+ * the eye, is outside the root cell), or was made lazily -- the index is
+ * then unchanged but stale, and must be reconstructed
+ */
+// HEADERBEG
+bool SpatialIndexRefit
+(
+   SpatialIndex*   pS,
+   const V3f*      pEyePosition,
+   const Triangle* aItems,
+   int             itemsLength,
+   int             first,
+   int             count
+)
+// HEADEREND
+{
+   bool isHeld = (aItems == pS->aTriangles) & (pS->deferredLength == 0) &
+      (first >= 0) & (count >= 0) & (first + count <= itemsLength);
+   int i;
+
+   /* eye must stay inside root cell (tracing algorithm relies on it) */
+   for( i = 3;  i-- > 0; )
+   {
+      isHeld &= (pEyePosition->v[i] >= pS->aBound[i]) &
+         (pEyePosition->v[i] <= pS->aBound[i + 3]);
+   }
+   if( !isHeld | (count == 0) ) return isHeld;
+
+   /* moved items' bounds: must be inside root cell in all dimensions */
+   float (*aaItemBounds)[6];
+   assert( aaItemBounds = (float(*)[6])malloc( count * sizeof(aaItemBounds[0]) ));
+
+#pragma omp parallel for reduction(&&:isHeld)
+   for( i = 0;  i < count;  ++i )
+   {
+      int j;
+      TriangleBound( &aItems[first + i], aaItemBounds[i] );
+      for( j = 0;  j < 6;  ++j )
+      {
+         isHeld = isHeld && (j < 3 ? aaItemBounds[i][j] >= pS->aBound[j] :
+            aaItemBounds[i][j] <= pS->aBound[j]);
+      }
+   }
+   if( !isHeld )
+   {
+      free( aaItemBounds );
+      return false;
+   }
+
+   /* make the cells they reach */
+   {
+      int capacity = pS->nodesLength;
+      for( i = 0;  i < count;  ++i )
+      {
+         growCells( pS, &capacity, 0, pS->aBound, aaItemBounds[i] );
+      }
+      if( capacity > pS->nodesLength )
+      {
+         pS->aNodes = (SpatialIndexNode*)huge_realloc( pS->aNodes,
+            pS->nodesLength * sizeof(SpatialIndexNode), "nodi indice" );
+      }
+   }
+
+   /* new leaf counts: the items not moved, then the moved arriving */
+   const int nodesLength = pS->nodesLength;
+   uint32_t* aCounts;
+   uint32_t* aFirsts;
+   assert( aCounts = (uint32_t*)malloc( nodesLength * sizeof(uint32_t) ));
+   assert( aFirsts = (uint32_t*)malloc( nodesLength * sizeof(uint32_t) ));
+
+#pragma omp parallel for schedule(static, 1024)
+   for( i = 0;  i < nodesLength;  ++i )
+   {
+      const SpatialIndexNode* pN = &pS->aNodes[i];
+      uint32_t kept = 0, k;
+      if( !isBranch( pN ) )
+      {
+         for( k = pN->b;  k < pN->b + pN->a;  ++k )
+         {
+            kept += pS->aItems[k] - first >= (uint32_t)count;
+         }
+      }
+      aCounts[i] = kept;
+   }
+
+#pragma omp parallel for
+   for( i = 0;  i < count;  ++i )
+   {
+      refitItem( pS, &pS->aNodes[0], pS->aBound, first + i, aaItemBounds[i],
+         aCounts, aFirsts, 0 );
+   }
+
+   /* lay the lists out again, in node order, kept items first */
+   int length = 0;
+   for( i = 0;  i < nodesLength;  ++i )
+   {
+      aFirsts[i] = length;
+      length    += aCounts[i];
+   }
+   uint32_t* aNewItems = (uint32_t*)huge_realloc( 0,
+      (length ? length : 1) * sizeof(uint32_t), "elementi indice" );
+
+#pragma omp parallel for schedule(static, 1024)
+   for( i = 0;  i < nodesLength;  ++i )
+   {
+      const SpatialIndexNode* pN = &pS->aNodes[i];
+      uint32_t kept = 0, k;
+      if( !isBranch( pN ) )
+      {
+         for( k = pN->b;  k < pN->b + pN->a;  ++k )
+         {
+            const uint32_t item = pS->aItems[k];
+            if( item - first >= (uint32_t)count ) aNewItems[aFirsts[i] + kept++] = item;
+         }
+      }
+      aCounts[i] = kept;
+   }
+
+#pragma omp parallel for
+   for( i = 0;  i < count;  ++i )
+   {
+      refitItem( pS, &pS->aNodes[0], pS->aBound, first + i, aaItemBounds[i],
+         aCounts, aFirsts, aNewItems );
+   }
+
+   for( i = 0;  i < nodesLength;  ++i )
+   {
+      SpatialIndexNode* pN = &pS->aNodes[i];
+      if( !isBranch( pN ) )
+      {
+         pN->a = aCounts[i];
+         pN->b = aFirsts[i];
+      }
+   }
+
+   huge_free( pS->aItems );
+   pS->aItems      = aNewItems;
+   pS->itemsLength = length;
+
+   free( aFirsts );
+   free( aCounts );
+   free( aaItemBounds );
+   return true;
+}
+
+
+
+
+/* queries ------------------------------------------------------------------ */
+
+/**
+ * Surface area heuristic estimate of tracing cost, relative to the root cell
+ * area. Compare before and after SpatialIndexRefit() to judge degradation.
+ */
+// HEADERBEG
+float SpatialIndexCost
+(
+   const SpatialIndex* pS
+)
+// HEADEREND
+{
+   const float side = pS->aBound[3] - pS->aBound[0];
+   return side > 0.0 ? cost( pS, &pS->aNodes[0], side ) / (side * side) : 0.0;
+}
+
+
+/**
+ * Memory used by the index (not counting the triangles).
+ */
+// HEADERBEG
+size_t SpatialIndexBytes
+(
+   const SpatialIndex* pS
+)
+// HEADEREND
+{
+   size_t bytes = sizeof(SpatialIndex) +
+      pS->nodesLength    * sizeof(SpatialIndexNode) +
+      pS->itemsLength    * sizeof(uint32_t) +
+      pS->deferredLength * sizeof(SpatialIndexDeferred) +
+      ArenaBytes( &pS->arena );
+
+   /* lazy cells: made ones (their items stay in the arena) */
+   int i;
+   for( i = pS->deferredLength;  i-- > 0; )
+   {
+      const SpatialIndexDeferred* pD = &pS->aDeferred[i];
+      if( __atomic_load_n( &pD->state, __ATOMIC_ACQUIRE ) == 2 )
+      {
+         bytes += SpatialIndexBytes( pD->pIndex );
+      }
+   }
+
+   return bytes;
+}
+
+
+/**
+ * Leaf occupancy: counts leaves by number of items (last bucket is that many
+ * or more), and returns total item references (an item straddling cells is
+ * referenced by each). Lazy cells count only once made.
+ */
+// HEADERBEG
+int SpatialIndexLeaves
+(
+   const SpatialIndex* pS,
+   int                 aHistogram_o[],
+   int                 histogramLength
+)
+// HEADEREND
+{
+   int references = 0;
+
+   int i;
+   for( i = pS->nodesLength;  i-- > 0; )
+   {
+      const SpatialIndexNode* pN = &pS->aNodes[i];
+      if( !isBranch( pN ) & !isLazy( pN ) )
+      {
+         ++aHistogram_o[(int)pN->a < histogramLength ? (int)pN->a :
+            histogramLength - 1];
+         references += pN->a;
+      }
+   }
+
+   for( i = pS->deferredLength;  i-- > 0; )
+   {
+      const SpatialIndexDeferred* pD = &pS->aDeferred[i];
+      if( __atomic_load_n( &pD->state, __ATOMIC_ACQUIRE ) == 2 )
+      {
+         references += SpatialIndexLeaves( pD->pIndex, aHistogram_o,
+            histogramLength );
+      }
+   }
+
+   return references;
+}
+
+
+// HEADERBEG
+void SpatialIndexIntersection
+(
+   const SpatialIndex* pS,
+   const V3f*     pRayOrigin,
+   const V3f*     pRayDirection,
+   const void*         lastHit,
+   const Triangle**    ppHitObject_o,
+   V3f*           pHitPosition_o
+)
+// HEADEREND
+{
+   STAT_ADD( rays, 1 );
+
+   *ppHitObject_o = 0;
+   intersect( pS, &pS->aNodes[0], pS->aBound, pRayOrigin, pRayDirection,
+      lastHit, pRayOrigin, ppHitObject_o, pHitPosition_o );
+}
+
+
+
+
+/* tuning ------------------------------------------------------------------- */
+
+static double seconds()
+{
+   struct timespec t;
+   clock_gettime( CLOCK_MONOTONIC, &t );
+   return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+
+/**
+ * Whether items and levels lie within the range SpatialIndexTune() sweeps --
+ * for checking settings read back from a file.
+ */
+// HEADERBEG
+bool SpatialIndexTuneInRange
+(
+   int items,
+   int levels
+)
+// HEADEREND
+{
+   const int itemsLast  = sizeof(TUNE_MAX_ITEMS) / sizeof(int) - 1;
+   const int levelsLast = sizeof(TUNE_MAX_LEVELS) / sizeof(int) - 1;
+   return (items >= TUNE_MAX_ITEMS[0]) & (items <= TUNE_MAX_ITEMS[itemsLast]) &
+      (levels >= TUNE_MAX_LEVELS[0]) & (levels <= TUNE_MAX_LEVELS[levelsLast]);
+}
+
+
+/**
+ * Set SpatialIndexMaxItems and SpatialIndexMaxLevels to those tracing a fixed
+ * set of sample rays fastest: half from the eye, half onward from where those
+ * hit, in uniformly random directions. Prints each setting tried.
+ */
+// HEADERBEG
+void SpatialIndexTune
+(
+   const V3f*      pEyePosition,
+   const Triangle* aItems,
+   int             itemsLength
+)
+// HEADEREND
+{
+   V3f*             aOrigins;
+   V3f*             aDirections;
+   const Triangle** apLastHits;
+   const int        lazyLevels = SpatialIndexLazyLevels;
+   int              i, j, bestItems = 0, bestLevels = 0;
+   double           bestTime = DBL_MAX;
+
+   assert( aOrigins    = (V3f*)malloc( TUNE_RAYS * sizeof(V3f)));
+   assert( aDirections = (V3f*)malloc( TUNE_RAYS * sizeof(V3f)));
+   assert( apLastHits  = (const Triangle**)calloc( TUNE_RAYS, sizeof(const Triangle*)));
+
+   /* whole tree for each setting */
+   SpatialIndexLazyLevels = 0;
+
+   /* make sample rays (with the current setting) */
+   {
+      Random* pRandom = RandomCreate();
+      const SpatialIndex* pS = SpatialIndexConstruct( pEyePosition, aItems, itemsLength );
+
+      for( i = 0;  i < TUNE_RAYS;  ++i )
+      {
+         /* uniform direction, by rejection from cube */
+         V3f d;
+         do
+         {
+            d = V3f( RandomReal64( pRandom ) * 2.0 - 1.0,
+               RandomReal64( pRandom ) * 2.0 - 1.0,
+               RandomReal64( pRandom ) * 2.0 - 1.0 );
+         }
+         while( (d.dot( d ) > 1.0) | (d.dot( d ) < 1e-6) );
+         aDirections[i] = d.normalized();
+         aOrigins[i]    = *pEyePosition;
+
+         /* second half continue from hits of first half */
+         if( i >= TUNE_RAYS / 2 )
+         {
+            const int e = i - TUNE_RAYS / 2;
+            V3f hit;
+            SpatialIndexIntersection( pS, &aOrigins[e], &aDirections[e], 0,
+               &apLastHits[i], &hit );
+            if( apLastHits[i] ) aOrigins[i] = hit;
+         }
+      }
+
+      SpatialIndexDestruct( (SpatialIndex*)pS );
+      free( pRandom );
+   }
+
+   /* sweep */
+   for( i = sizeof(TUNE_MAX_ITEMS) / sizeof(int);  i-- > 0; )
+   {
+      for( j = sizeof(TUNE_MAX_LEVELS) / sizeof(int);  j-- > 0; )
+      {
+         SpatialIndexMaxItems  = TUNE_MAX_ITEMS[i];
+         SpatialIndexMaxLevels = TUNE_MAX_LEVELS[j];
+
+         const double t0 = seconds();
+         const SpatialIndex* pS = SpatialIndexConstruct( pEyePosition, aItems, itemsLength );
+         const double build = seconds() - t0;
+
+         double trace = DBL_MAX;
+         for( int k = TUNE_REPEATS;  k-- > 0; )
+         {
+            const double t1 = seconds();
+            int r;
+#pragma omp parallel for schedule(static, 1024)
+            for( r = 0;  r < TUNE_RAYS;  ++r )
+            {
+               const Triangle* pHit;
+               V3f hit;
+               SpatialIndexIntersection( pS, &aOrigins[r], &aDirections[r],
+                  apLastHits[r], &pHit, &hit );
+            }
+            const double t = seconds() - t1;
+            if( trace > t ) trace = t;
+         }
+
+         fprintf( stderr, "index tune: items %2d levels %2d  build %8.3fs  "
+            "%6.2f Mrays/s  %zu bytes\n", SpatialIndexMaxItems,
+            SpatialIndexMaxLevels, build, TUNE_RAYS / trace * 1e-6,
+            SpatialIndexBytes( pS ));
+
+         if( bestTime > trace )
+         {
+            bestTime   = trace;
+            bestItems  = SpatialIndexMaxItems;
+            bestLevels = SpatialIndexMaxLevels;
+         }
+
+         SpatialIndexDestruct( (SpatialIndex*)pS );
+      }
+   }
+
+   SpatialIndexMaxItems   = bestItems;
+   SpatialIndexMaxLevels  = bestLevels;
+   SpatialIndexLazyLevels = lazyLevels;
+   fprintf( stderr, "index tune: best items %d levels %d\n", bestItems, bestLevels );
+
+   free( apLastHits );
+   free( aDirections );
+   free( aOrigins );
+}
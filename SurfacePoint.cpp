@@ -13,6 +13,7 @@
 #include <Triangle.h>   // HEADER
 #include <V3f.h>   // HEADER
 #include <Random.h>   // HEADER
+#include <stats.h>
 
 
 
@@ -138,6 +139,8 @@ bool SurfacePointNextDirection
 
    /* russian-roulette for reflectance 'magnitude' */
    const bool isAlive = RandomReal64( pRandom ) < reflectivityMean;
+   STAT_ADD( rr_tests, 1 );
+   STAT_ADD( rr_kills, !isAlive );
 
    if( isAlive )
    {
@@ -0,0 +1,564 @@
+
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <omp.h>
+
+#include <prof.h>
+#include <Scene.h>
+#include <SurfacePoint.h>
+#include <Random.h>
+
+
+// benchmark con scene procedurali
+//
+//     ./bench [-d DIR] [-n MAXTRIS] [-o FILE] [-a FRAMES]
+//
+// genera (se mancano) le scene in DIR come .obj/.mtl, per ogni
+// famiglia e per taglie da 1K a 10M triangoli, poi per ognuna misura
+// caricamento, costruzione indice, raggi primari/secondari/ombra al
+// secondo, e memoria per triangolo; i risultati vanno in json
+//
+// con -a ogni scena si anima anche per FRAMES frame: l'ultimo ottavo dei
+// triangoli (un'istanza rigida) ruota e sale, SceneRefit() aggiorna
+// l'indice e i primari si confrontano con quelli di una copia della
+// scena indicizzata da zero; si misurano refit contro costruzione
+//
+// room.obj ha un centinaio di triangoli, troppo pochi per vedere
+// qualcosa di indice e cache
+
+
+
+#define BENCH_SIDE  512    // raggi primari: griglia BENCH_SIDE^2
+
+
+static const int SIZES[] = { 1000, 10000, 100000, 1000000, 10000000 };
+
+static const V3f EYE( 0.5, 0.5, -1.0 );
+static const V3f HALF( 0.5, 0.5, 0.5 );
+
+
+
+
+// generatori ------------------------------------------------------------------
+
+// tutte le scene stanno nel cubo [0,1]^3, visto da EYE verso +z
+// ogni triangolo si porta i suoi 3 vertici, niente condivisione:
+// file più grossi ma generatori banali
+// i deterministici (cornell, spheres) ignorano il Random della tabella
+
+struct OBJ {
+    FILE *f;
+    int   tris;
+    int   verts;
+};
+
+
+static void obj_tri( OBJ *o, V3f a, V3f b, V3f c ){
+    // obj_import non gestisce gli indici negativi
+    const int v = o->verts;
+    fprintf( o->f, "v %f %f %f\nv %f %f %f\nv %f %f %f\nf %d/1/1 %d/1/1 %d/1/1\n"
+        , a.X(), a.Y(), a.Z(), b.X(), b.Y(), b.Z(), c.X(), c.Y(), c.Z(), v+1, v+2, v+3 );
+    o->verts += 3;
+    o->tris++;
+}
+
+
+static void obj_quad( OBJ *o, V3f a, V3f b, V3f c, V3f d ){
+    obj_tri( o, a, b, c );
+    obj_tri( o, a, c, d );
+}
+
+
+static void obj_mtl( OBJ *o, const char *name ){
+    fprintf( o->f, "usemtl %s\n", name );
+}
+
+
+// quadrilatero a,b,c,d suddiviso in k*k quad
+static void obj_grid( OBJ *o, V3f a, V3f b, V3f c, V3f d, int k ){
+    for( int j=0; j<k; j++ ){
+        for( int i=0; i<k; i++ ){
+            #define P(U,V) ( a*((1-(U))*(1-(V))) + b*((U)*(1-(V))) + c*((U)*(V)) + d*((1-(U))*(V)) )
+            const double u0 = (double)i/k, u1 = (double)(i+1)/k;
+            const double v0 = (double)j/k, v1 = (double)(j+1)/k;
+            obj_quad( o, P(u0,v0), P(u1,v0), P(u1,v1), P(u0,v1));
+            #undef P
+        }
+    }
+}
+
+
+static V3f rnd3( Random *r ){
+    return V3f( RandomReal64( r ), RandomReal64( r ), RandomReal64( r ));
+}
+
+
+
+
+static void gen_cornell( OBJ *o, int n, Random * ){
+    // 5 pareti tassellate, luce a soffitto, due blocchi
+    const int k = (int)fmax( 1, sqrt(( n - 24 ) / 10.0 ));
+
+    obj_mtl( o, "white" );
+    obj_grid( o, V3f(0,0,0), V3f(1,0,0), V3f(1,0,1), V3f(0,0,1), k );  // pavimento
+    obj_grid( o, V3f(0,1,0), V3f(0,1,1), V3f(1,1,1), V3f(1,1,0), k );  // soffitto
+    obj_grid( o, V3f(0,0,1), V3f(1,0,1), V3f(1,1,1), V3f(0,1,1), k );  // fondo
+    obj_mtl( o, "red" );
+    obj_grid( o, V3f(0,0,0), V3f(0,0,1), V3f(0,1,1), V3f(0,1,0), k );
+    obj_mtl( o, "green" );
+    obj_grid( o, V3f(1,0,0), V3f(1,1,0), V3f(1,1,1), V3f(1,0,1), k );
+
+    obj_mtl( o, "light" );
+    obj_quad( o, V3f(0.4,0.999,0.4), V3f(0.4,0.999,0.6), V3f(0.6,0.999,0.6), V3f(0.6,0.999,0.4));
+
+    obj_mtl( o, "white" );
+    for( int b=0; b<2; b++ ){
+        const V3f p0 = b ? V3f(0.55,0,0.55) : V3f(0.15,0,0.25);
+        const V3f s  = b ? V3f(0.3,0.6,0.3) : V3f(0.3,0.3,0.3);
+        const V3f p1 = p0 + s;
+        obj_quad( o, V3f(p0.X(),p1.Y(),p0.Z()), V3f(p0.X(),p1.Y(),p1.Z()), V3f(p1.X(),p1.Y(),p1.Z()), V3f(p1.X(),p1.Y(),p0.Z()));
+        obj_quad( o, V3f(p0.X(),p0.Y(),p0.Z()), V3f(p0.X(),p1.Y(),p0.Z()), V3f(p1.X(),p1.Y(),p0.Z()), V3f(p1.X(),p0.Y(),p0.Z()));
+        obj_quad( o, V3f(p0.X(),p0.Y(),p1.Z()), V3f(p1.X(),p0.Y(),p1.Z()), V3f(p1.X(),p1.Y(),p1.Z()), V3f(p0.X(),p1.Y(),p1.Z()));
+        obj_quad( o, V3f(p0.X(),p0.Y(),p0.Z()), V3f(p0.X(),p0.Y(),p1.Z()), V3f(p0.X(),p1.Y(),p1.Z()), V3f(p0.X(),p1.Y(),p0.Z()));
+        obj_quad( o, V3f(p1.X(),p0.Y(),p0.Z()), V3f(p1.X(),p1.Y(),p0.Z()), V3f(p1.X(),p1.Y(),p1.Z()), V3f(p1.X(),p0.Y(),p1.Z()));
+    }
+}
+
+
+
+static void gen_soup( OBJ *o, int n, Random *r ){
+    // triangoli casuali, lato ~ spaziatura media, con una luce sopra
+    const double s = 2.0 / cbrt( n );
+
+    obj_mtl( o, "light" );
+    obj_quad( o, V3f(0.3,1.2,0.3), V3f(0.3,1.2,0.7), V3f(0.7,1.2,0.7), V3f(0.7,1.2,0.3));
+
+    obj_mtl( o, "white" );
+    for( int i=2; i<n; i++ ){
+        const V3f c = rnd3( r );
+        obj_tri( o, c, c + (rnd3( r ) - HALF)*s, c + (rnd3( r ) - HALF)*s );
+    }
+}
+
+
+
+static void gen_spheres( OBJ *o, int n, Random * ){
+    // griglia di sfere uv da 16x16 su un pavimento
+    const int seg = 16;
+    const int per = 2*seg*seg;
+    const int m   = (int)fmax( 1, ceil( sqrt(( n - 4 ) / (double)per )));
+    const double R = 0.45 / m;
+
+    obj_mtl( o, "light" );
+    obj_quad( o, V3f(0.3,1.2,0.3), V3f(0.3,1.2,0.7), V3f(0.7,1.2,0.7), V3f(0.7,1.2,0.3));
+    obj_mtl( o, "white" );
+    obj_quad( o, V3f(0,0,0), V3f(0,0,1), V3f(1,0,1), V3f(1,0,0));
+
+    for( int j=0; j<m && o->tris < n; j++ ){
+        for( int i=0; i<m && o->tris < n; i++ ){
+            const V3f c( (i+0.5)/m, R, (j+0.5)/m );
+            obj_mtl( o, (i+j)&1 ? "red" : "white" );
+            for( int b=0; b<seg; b++ ){
+                for( int a=0; a<seg; a++ ){
+                    #define S(A,B) ( c + V3f( sin(M_PI*(B)/seg)*cos(2*M_PI*(A)/seg), cos(M_PI*(B)/seg), sin(M_PI*(B)/seg)*sin(2*M_PI*(A)/seg) )*R )
+                    obj_quad( o, S(a,b), S(a+1,b), S(a+1,b+1), S(a,b+1));
+                    #undef S
+                }
+            }
+        }
+    }
+}
+
+
+
+static void gen_forest( OBJ *o, int n, Random *r ){
+    // fili d'erba/fusti: quad lunghi e sottili, ogni fusto in più celle
+    // quasi verticali: l'indice ragiona sui bounding box, e fusti
+    // inclinati si sovrappongono tutti, mandando l'ottree a fondo scala
+    obj_mtl( o, "light" );
+    obj_quad( o, V3f(0.3,1.2,0.3), V3f(0.3,1.2,0.7), V3f(0.7,1.2,0.7), V3f(0.7,1.2,0.3));
+    obj_mtl( o, "white" );
+    obj_quad( o, V3f(0,0,0), V3f(0,0,1), V3f(1,0,1), V3f(1,0,0));
+
+    obj_mtl( o, "green" );
+    const double w = 0.02 / cbrt( n );
+    while( o->tris < n ){
+        const V3f   base( RandomReal64( r ), 0, RandomReal64( r ));
+        const double h   = 0.3 + 0.7*RandomReal64( r );
+        const double a   = 2*M_PI*RandomReal64( r );
+        const V3f   side( cos(a)*w, 0, sin(a)*w );
+        const V3f   lean( (RandomReal64( r )-0.5)*w, h, (RandomReal64( r )-0.5)*w );
+        obj_quad( o, base - side, base + side, base + side + lean, base - side + lean );
+    }
+}
+
+
+
+static void gen_emitters( OBJ *o, int n, Random *r ){
+    // metà triangoli sono piccole luci sparse in alto,
+    // metà occlusori sparsi in basso
+    const double s = 2.0 / cbrt( n );
+
+    obj_mtl( o, "white" );
+    obj_quad( o, V3f(0,0,0), V3f(0,0,1), V3f(1,0,1), V3f(1,0,0));
+
+    for( int i=2; i<n; i++ ){
+        const bool emit = i & 1;
+        V3f c = rnd3( r );
+        c = V3f( c.X(), emit ? 0.5 + 0.5*c.Y() : 0.5*c.Y(), c.Z());
+        obj_mtl( o, emit ? "spark" : "white" );
+        obj_tri( o, c, c + (rnd3( r ) - HALF)*s, c + (rnd3( r ) - HALF)*s );
+    }
+}
+
+
+
+// forest si ferma a 100K: anche verticali, i bounding box dei fusti
+// riempiono il volume e l'indice cresce ben più che linearmente
+// (~3KB/triangolo a 100K), a 1M non sta in memoria
+static const struct {
+    const char *name;
+    void (*gen)( OBJ *o, int n, Random *r );
+    int max_tris;
+} GENERATORS[] = {
+    { "cornell",  gen_cornell,  10000000 },
+    { "soup",     gen_soup,     10000000 },
+    { "spheres",  gen_spheres,  10000000 },
+    { "forest",   gen_forest,     100000 },
+    { "emitters", gen_emitters, 10000000 },
+};
+
+
+
+static void write_mtl( const char *path ){
+    FILE *f;
+    assert( f = fopen( path, "wb" ));
+    // Ke viene moltiplicato da obj_import
+    fprintf( f,
+        "newmtl white\nKd 0.7 0.7 0.7\nKe 0 0 0\n"
+        "newmtl red\nKd 0.7 0.1 0.1\nKe 0 0 0\n"
+        "newmtl green\nKd 0.1 0.7 0.1\nKe 0 0 0\n"
+        "newmtl light\nKd 0 0 0\nKe 1 1 1\n"
+        "newmtl spark\nKd 0 0 0\nKe 0.01 0.01 0.01\n" );
+    fclose( f );
+}
+
+
+
+static void generate( const char *path, int g, int n ){
+    fprintf( stderr, "bench: genero %s\n", path );
+    OBJ o = { 0, 0, 0 };
+    assert( o.f = fopen( path, "wb" ));
+    fprintf( o.f, "# %s, %d triangoli, generato da bench\nmtllib bench.mtl\n", GENERATORS[g].name, n );
+    Random *r = RandomCreate();
+    GENERATORS[g].gen( &o, n, r );
+    free( r );
+    fclose( o.f );
+}
+
+
+
+
+// misure ----------------------------------------------------------------------
+
+static Random *thread_random(){
+    // stato diverso per thread, altrimenti tutti tirano gli stessi raggi
+    Random *r = RandomCreate();
+    for( int i=0; i<4; i++ ) r->state[i] += 7919 * omp_get_thread_num();
+    return r;
+}
+
+
+
+static double seconds( uint64_t t0 ){
+    return ( prof_now() - t0 ) * 1e-9;
+}
+
+
+
+struct HIT {
+    const Triangle *pTriangle;
+    V3f             position;
+};
+
+
+
+static double trace_primary( const Scene *pS, HIT *aHits ){
+    const double tanView = tan( 40 * M_PI / 180 * 0.5 );
+    const uint64_t t0 = prof_now();
+
+#pragma omp parallel for schedule(dynamic,4)
+    for( int y=0; y<BENCH_SIDE; y++ ){
+        for( int x=0; x<BENCH_SIDE; x++ ){
+            const V3f d = V3f(
+                ((x + 0.5) * 2.0 / BENCH_SIDE - 1.0) * tanView,
+                (1.0 - (y + 0.5) * 2.0 / BENCH_SIDE) * tanView,
+                1.0 ).normalized();
+            HIT *h = &aHits[y*BENCH_SIDE+x];
+            SceneIntersection( pS, &EYE, &d, 0, &h->pTriangle, &h->position );
+        }
+    }
+
+    return BENCH_SIDE*BENCH_SIDE / seconds( t0 );
+}
+
+
+
+static double trace_secondary( const Scene *pS, const HIT *aHits, int *pRays ){
+    int rays = 0;
+    const uint64_t t0 = prof_now();
+
+#pragma omp parallel reduction(+:rays)
+    {
+    Random *r = thread_random();
+#pragma omp for schedule(dynamic,1024)
+    for( int i=0; i<BENCH_SIDE*BENCH_SIDE; i++ ){
+        const HIT *h = &aHits[i];
+        if( !h->pTriangle ) continue;
+
+        // direzione uniforme nell'emisfero verso l'occhio
+        V3f n = TriangleNormal( h->pTriangle );
+        if( n.dot( EYE - h->position ) < 0 ) n = -n;
+        V3f d;
+        do d = rnd3( r ) * 2.0 - V3f::ONE; while( d.dot( d ) > 1 || d.is_zero());
+        if( d.dot( n ) < 0 ) d = -d;
+        d = d.normalized();
+
+        const Triangle *pHit;
+        V3f hit;
+        SceneIntersection( pS, &h->position, &d, h->pTriangle, &pHit, &hit );
+        rays++;
+    }
+    free( r );
+    }
+
+    *pRays = rays;
+    return rays / seconds( t0 );
+}
+
+
+
+static double trace_shadow( const Scene *pS, const HIT *aHits, int *pRays ){
+    int rays = 0;
+    const uint64_t t0 = prof_now();
+
+#pragma omp parallel reduction(+:rays)
+    {
+    Random *r = thread_random();
+#pragma omp for schedule(dynamic,1024)
+    for( int i=0; i<BENCH_SIDE*BENCH_SIDE; i++ ){
+        const HIT *h = &aHits[i];
+        if( !h->pTriangle ) continue;
+
+        V3f p;
+        const Triangle *pEmitter;
+        SceneEmitter( pS, r, &p, &pEmitter );
+        if( !pEmitter ) continue;
+
+        const V3f d = ( p - h->position ).normalized();
+        const Triangle *pHit;
+        V3f hit;
+        SceneIntersection( pS, &h->position, &d, h->pTriangle, &pHit, &hit );
+        rays++;
+    }
+    free( r );
+    }
+
+    *pRays = rays;
+    return rays / seconds( t0 );
+}
+
+
+
+static M34 animation( const V3f &c, int f ){
+    // piccola oscillazione attorno al centro dell'istanza: resta nel
+    // margine della cella radice, uscendone si ricostruisce
+    M34 m;
+    m.translate( c.X(), c.Y() + 0.005*sin( f*0.3 ), c.Z());
+    m.rotate_y( 0.02*sin( f*0.2 ));
+    m.translate( -c.X(), -c.Y(), -c.Z());
+    return m;
+}
+
+
+
+static int compare_hits( const Scene *pA, const HIT *aA, const Scene *pB, const HIT *aB ){
+    // stessi triangoli nello stesso ordine; sugli spigoli condivisi può
+    // vincere l'uno o l'altro vicino, conta solo se cambia il punto
+    int mismatches = 0;
+    for( int i=0; i<BENCH_SIDE*BENCH_SIDE; i++ ){
+        const bool hitA = aA[i].pTriangle, hitB = aB[i].pTriangle;
+        if( hitA != hitB ){ mismatches++; continue; }
+        const V3f d = aA[i].position - aB[i].position;
+        if( hitA && aA[i].pTriangle - pA->aTriangles != aB[i].pTriangle - pB->aTriangles
+            && d.dot( d ) > 1e-8 ) mismatches++;
+    }
+    return mismatches;
+}
+
+
+
+struct ANIMATION {
+    double update_s;        // SceneRefit() per frame, ricostruzioni comprese
+    double refit_s;         // per frame in cui il refit è bastato
+    double build_s;         // SceneIndex() della copia, per frame
+    int    rebuilds;        // frame in cui SceneRefit() ha ricostruito
+    int    mismatches;      // primari diversi dalla copia ricostruita, in tutto
+};
+
+
+
+static ANIMATION animate( Scene *pS, const char *path, int frames, HIT *aHits, HIT *aFresh ){
+    ANIMATION a = { 0, 0, 0, 0, 0 };
+    const int count = pS->trianglesLength / 8;
+    const int first = pS->trianglesLength - count;
+
+    V3f c( 0, 0, 0 );
+    for( int i=first; i<first+count; i++ ) c = c + pS->aTriangles[i].aVertexs[0];
+    c = c * ( 1.0 / count );
+
+    // la copia parte dagli stessi vertici e si indicizza ogni frame
+    Scene *pFresh = SceneConstruct( path, &EYE );
+
+    for( int f=1; f<=frames; f++ ){
+        M34 m = animation( c, f );
+
+        uint64_t t0 = prof_now();
+        SceneTransform( pS, first, count, &m );
+        const bool rebuilt = SceneRefit( pS, &EYE );
+        const double t = seconds( t0 );
+        a.update_s += t;
+        if( rebuilt ) a.rebuilds++;
+        else          a.refit_s += t;
+
+        t0 = prof_now();
+        SceneTransform( pFresh, first, count, &m );
+        SceneIndex( pFresh, &EYE );
+        a.build_s  += seconds( t0 );
+
+        trace_primary( pS, aHits );
+        trace_primary( pFresh, aFresh );
+        a.mismatches += compare_hits( pS, aHits, pFresh, aFresh );
+    }
+
+    SceneDestruct( pFresh );
+    a.update_s /= frames;
+    a.refit_s  /= frames > a.rebuilds ? frames - a.rebuilds : 1;
+    a.build_s  /= frames;
+    return a;
+}
+
+
+
+
+static void usage( const char *argv0 ){
+    fprintf( stderr,
+        "usage: %s [options]\n"
+        "  -d DIR      where generated scenes are kept (default bench-scenes)\n"
+        "  -n MAXTRIS  skip sizes above MAXTRIS (default 10000000)\n"
+        "  -o FILE     json results (default bench.json)\n"
+        "  -a FRAMES   also animate each scene for FRAMES frames: refit vs rebuild\n"
+        , argv0 );
+    exit( 1 );
+}
+
+
+
+int main( int argc, char *argv[]){
+
+    const char *dir      = "bench-scenes";
+    const char *out_path = "bench.json";
+    int         max_tris = 10000000;
+    int         frames   = 0;
+
+    int opt;
+    while(( opt = getopt( argc, argv, "d:n:o:a:" )) != -1 ){
+        switch( opt ){
+            case 'd': dir      = optarg; break;
+            case 'n': max_tris = atoi( optarg ); break;
+            case 'o': out_path = optarg; break;
+            case 'a': frames   = atoi( optarg ); break;
+            default : usage( argv[0] );
+        }
+    }
+
+    mkdir( dir, 0755 );
+    char path[4096];
+    snprintf( path, sizeof(path), "%s/bench.mtl", dir );
+    write_mtl( path );
+
+    FILE *out;
+    assert( out = fopen( out_path, "wb" ));
+    fprintf( out, "{\"threads\":%d,\"primary_rays\":%d,\"scenes\":[\n", omp_get_max_threads(), BENCH_SIDE*BENCH_SIDE );
+
+    HIT *aHits, *aFresh;
+    assert( aHits  = (HIT*)malloc( BENCH_SIDE*BENCH_SIDE*sizeof(HIT)));
+    assert( aFresh = (HIT*)malloc( BENCH_SIDE*BENCH_SIDE*sizeof(HIT)));
+
+    bool first = true;
+    for( unsigned g=0; g<sizeof(GENERATORS)/sizeof(GENERATORS[0]); g++ ){
+        for( unsigned s=0; s<sizeof(SIZES)/sizeof(SIZES[0]); s++ ){
+
+            if( SIZES[s] > max_tris || SIZES[s] > GENERATORS[g].max_tris ) break;
+
+            snprintf( path, sizeof(path), "%s/%s-%d.obj", dir, GENERATORS[g].name, SIZES[s] );
+            if( access( path, R_OK )) generate( path, g, SIZES[s] );
+
+            // SceneConstruct carica e indicizza, poi ricostruiamo per separare i tempi
+            uint64_t t0 = prof_now();
+            Scene *pS = SceneConstruct( path, &EYE );
+            const double construct_s = seconds( t0 );
+
+            t0 = prof_now();
+            SceneIndex( pS, &EYE );
+            const double build_s = seconds( t0 );
+
+            int secondary, shadow;
+            const double primary_rps   = trace_primary( pS, aHits );
+            const double secondary_rps = trace_secondary( pS, aHits, &secondary );
+            const double shadow_rps    = trace_shadow( pS, aHits, &shadow );
+
+            const double index_bpt = (double)SpatialIndexBytes( pS->pIndex ) / pS->trianglesLength;
+
+            fprintf( stderr, "bench: %-8s %9d tris  load %.3fs  build %.3fs  %.2f / %.2f / %.2f Mrays/s  %.1f B/tri\n"
+                , GENERATORS[g].name, pS->trianglesLength, construct_s - build_s, build_s
+                , primary_rps*1e-6, secondary_rps*1e-6, shadow_rps*1e-6, index_bpt + sizeof(Triangle));
+
+            fprintf( out, "%s{\"name\":\"%s\",\"size\":%d,\"triangles\":%d,\"emitters\":%d"
+                ",\"load_s\":%.6f,\"build_s\":%.6f"
+                ",\"primary_rays_per_s\":%.0f,\"secondary_rays\":%d,\"secondary_rays_per_s\":%.0f"
+                ",\"shadow_rays\":%d,\"shadow_rays_per_s\":%.0f"
+                ",\"index_bytes_per_triangle\":%.2f,\"triangle_bytes\":%zu"
+                , first ? "" : ",\n", GENERATORS[g].name, SIZES[s], pS->trianglesLength, pS->emittersLength
+                , construct_s - build_s, build_s
+                , primary_rps, secondary, secondary_rps, shadow, shadow_rps
+                , index_bpt, sizeof(Triangle));
+
+            if( frames > 0 ){
+                const ANIMATION a = animate( pS, path, frames, aHits, aFresh );
+                fprintf( stderr, "bench: %-8s %9s       refit %.3fs  build %.3fs  update %.3fs  %d/%d ricostruiti  %d primari diversi\n"
+                    , GENERATORS[g].name, "", a.refit_s, a.build_s, a.update_s, a.rebuilds, frames, a.mismatches );
+                fprintf( out, ",\"animation\":{\"frames\":%d,\"refit_s\":%.6f,\"build_s\":%.6f"
+                    ",\"update_s\":%.6f,\"rebuilds\":%d,\"mismatches\":%d}"
+                    , frames, a.refit_s, a.build_s, a.update_s, a.rebuilds, a.mismatches );
+            }
+            fprintf( out, "}" );
+            fflush( out );
+            first = false;
+
+            SceneDestruct( pS );
+        }
+    }
+
+    fprintf( out, "\n]}\n" );
+    fclose( out );
+    free( aFresh );
+    free( aHits );
+    return 0;
+}
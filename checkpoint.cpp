@@ -0,0 +1,186 @@
+
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <SDL.h>
+#include <globals.h>
+#include <hdr.h>
+#include <render.h>
+#include <Camera.h>
+
+
+// checkpoint dei render lunghi: l'accumulo sopravvive a uscite e crash
+//
+//     ./main -k notte.ckpt scena.obj      riprende da notte.ckpt, se c'è
+//     kill -USR1 <pid>                    checkpoint adesso
+//
+// si scrive ogni -K secondi (default 300), su SIGUSR1 e all'uscita
+// il file ha tutto quello che serve a continuare la convergenza:
+//
+//     CKPT_MAGIC W H triangoli      riga di testo, per riconoscerlo
+//     vista dell'accumulo, expo, speed_mult
+//     stato di pRandom, da cui CameraFrame divide i flussi dei tasselli
+//     per pixel: accumulo, conteggi, primi impatti (hdr_write)
+//
+// in anteprima (-P, in movimento) l'accumulo sono blocchi da buttare: non
+// si scrive, la richiesta aspetta la piena risoluzione e all'uscita resta
+// il checkpoint precedente; si riprende sempre a piena risoluzione
+//
+// la scrittura avviene a render fermo, in un .tmp poi rinominato:
+// un crash a metà lascia intatto il checkpoint precedente
+// ripartendo, la prossima passata usa gli stessi numeri casuali che
+// avrebbe usato la sessione interrotta
+
+
+
+#define CKPT_MAGIC  "MLCKPT2"
+
+
+static const char            *ckpt_path;
+static Uint32                 interval_ms;
+static Uint32                 saved_ticks;
+static volatile sig_atomic_t  requested;
+
+
+
+
+static void on_signal( int ){
+    requested = 1;
+}
+
+
+
+void checkpoint_start( const char *path, float interval_s ) // HEADER
+{
+    ckpt_path   = path;
+    interval_ms = interval_s * 1000;
+    saved_ticks = SDL_GetTicks();
+
+    struct sigaction sa;
+    memset( &sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sa.sa_flags   = SA_RESTART;
+    sigaction( SIGUSR1, &sa, 0 );
+}
+
+
+
+static M34 applied_view(){
+    // la vista dell'accumulo è quella di pCamera: camera può essere già
+    // più avanti, loop() applica i movimenti una volta per frame
+    // (camera_pending); è frame_camera() al contrario
+    const Camera *pC = pCamera;
+    M34 m;
+    m.x.x = pC->right.X();          m.x.y = pC->right.Y();          m.x.z = pC->right.Z();
+    m.y.x = pC->up.X();             m.y.y = pC->up.Y();             m.y.z = pC->up.Z();
+    m.z.x = pC->viewDirection.X();  m.z.y = pC->viewDirection.Y();  m.z.z = pC->viewDirection.Z();
+    m.t.x = pC->viewPosition.X();   m.t.y = pC->viewPosition.Y();   m.t.z = pC->viewPosition.Z();
+    return m;
+}
+
+
+
+static bool write_all( FILE *f ){
+    // a render fermo
+    const M34 view = applied_view();
+    fprintf( f, CKPT_MAGIC " %d %d %d\n", W, H, pScene->trianglesLength );
+    return 1 == fwrite( view.raw, sizeof(view.raw), 1, f )
+        && 1 == fwrite( &expo, sizeof(expo), 1, f )
+        && 1 == fwrite( &speed_mult, sizeof(speed_mult), 1, f )
+        && 1 == fwrite( pRandom, sizeof(*pRandom), 1, f )
+        && hdr_write( f );
+}
+
+
+
+void checkpoint_save() // HEADER
+{
+    if( !ckpt_path ) return;
+    if( CameraFrameStep > 1 ){
+        fprintf( stderr, "checkpoint: in anteprima, non scritto\n" );
+        return;
+    }
+
+    char tmp[4096];
+    snprintf( tmp, sizeof(tmp), "%s.tmp", ckpt_path );
+    FILE *f = fopen( tmp, "wb" );
+    if( !f ){
+        perror( tmp );
+        return;
+    }
+
+    // la passata in corso si abbandona, quanto fatto resta nell'accumulo
+    const Uint32 t0 = SDL_GetTicks();
+    render_pause();
+    bool ok = write_all( f );
+    render_resume();
+    ok = !fclose( f ) && ok;
+
+    if( !ok || rename( tmp, ckpt_path )){
+        perror( ckpt_path );
+        remove( tmp );
+        return;
+    }
+    fprintf( stderr, "checkpoint: %s, %u ms\n", ckpt_path, SDL_GetTicks()-t0 );
+}
+
+
+
+bool checkpoint_load() // HEADER
+{
+    // a render fermo, dopo last_load(): la vista del checkpoint vince
+    if( !ckpt_path ) return false;
+    FILE *f = fopen( ckpt_path, "rb" );
+    if( !f ) return false;
+
+    // la riga a parte: in fscanf lo "\n" salterebbe anche i byte binari
+    // che sembrano spazi
+    char line[256];
+    int w, h, triangles;
+    bool ok = fgets( line, sizeof(line), f )
+        && 3 == sscanf( line, CKPT_MAGIC " %d %d %d", &w, &h, &triangles )
+        && w == W && h == H && triangles == pScene->trianglesLength;
+    if( !ok ){
+        fclose( f );
+        fprintf( stderr, "checkpoint: %s non è di questa scena o risoluzione, si parte da zero\n", ckpt_path );
+        return false;
+    }
+
+    M34    c = camera;
+    float  e = expo;
+    int    m = speed_mult;
+    Random r;
+    ok = 1 == fread( c.raw, sizeof(c.raw), 1, f )
+        && 1 == fread( &e, sizeof(e), 1, f )
+        && 1 == fread( &m, sizeof(m), 1, f )
+        && 1 == fread( &r, sizeof(r), 1, f )
+        && hdr_read( f );
+    fclose( f );
+    if( !ok ){
+        hdr_zero();
+        fprintf( stderr, "checkpoint: %s troncato, si parte da zero\n", ckpt_path );
+        return false;
+    }
+
+    camera          = c;
+    expo            = e;
+    speed_mult      = m;
+    CameraFrameStep = 1;
+    *pRandom        = r;
+    fprintf( stderr, "checkpoint: ripreso da %s, %.1f campioni per pixel\n", ckpt_path, hdr_snapshot());
+    return true;
+}
+
+
+
+void checkpoint_poll() // HEADER
+{
+    // dal ciclo degli eventi, una volta per iterazione
+    if( !ckpt_path ) return;
+    const Uint32 now = SDL_GetTicks();
+    if( !requested && !( interval_ms && now - saved_ticks >= interval_ms )) return;
+    if( CameraFrameStep > 1 ) return;   // dopo l'anteprima
+    requested   = 0;
+    saved_ticks = now;
+    checkpoint_save();
+}
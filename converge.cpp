@@ -0,0 +1,218 @@
+
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <prof.h>
+#include <globals.h>
+#include <hdr.h>
+#include <last.h>
+#include <Camera.h>
+#include <Scene.h>
+#include <Random.h>
+
+
+// convergenza: errore contro tempo, non raggi al secondo
+//
+//     ./converge [opzioni] scene.obj...
+//
+// per ogni scena rende senza finestra un riferimento ad alti spp
+// (tenuto in scene.obj.ref, rifatto se cambiano W, H, spp o vista), poi
+// rende la configurazione corrente da zero e a intervalli regolari
+// scrive RMSE e relMSE contro il riferimento, una riga json per punto
+//
+// si confronta la stima grezza (HDR/samples): il firefly_filter è
+// un ritocco di visualizzazione e sporcherebbe il confronto
+//
+// riferimento e candidato usano semi diversi, altrimenti i primi
+// campioni del candidato sarebbero gli stessi del riferimento
+
+
+
+#define REF_MAGIC  "MLREF"
+#define REL_EPS    1e-2     // relMSE = (x-r)^2 / (r^2 + REL_EPS)
+
+
+static int    ref_spp     = 1024;
+static double duration_s  = 10;
+static double interval_s  = 0.5;
+static bool   last_view   = false;
+
+
+
+
+static double seconds( uint64_t t0 ){
+    return ( prof_now() - t0 ) * 1e-9;
+}
+
+
+
+static void camera_setup(){
+    if( !last_view ) return;
+    // come frame(), dalla vista salvata dalla sessione interattiva
+    last_load();
+    pCamera->viewPosition  = V3f( camera.t.x, camera.t.y, camera.t.z );
+    pCamera->viewDirection = V3f( camera.z.x, camera.z.y, camera.z.z );
+    pCamera->right         = V3f( camera.x.x, camera.x.y, camera.x.z );
+    pCamera->up            = V3f( camera.y.x, camera.y.y, camera.y.z );
+}
+
+
+
+static bool ref_load( const char *path, V3f *aRef ){
+    FILE *f = fopen( path, "rb" );
+    if( !f ) return false;
+    // la riga a parte: in fscanf lo "\n" salterebbe anche i byte della
+    // camera che sembrano spazi
+    char line[256];
+    int w, h, spp;
+    Camera view;
+    bool ok = fgets( line, sizeof(line), f )
+        && 3 == sscanf( line, REF_MAGIC " %d %d %d", &w, &h, &spp )
+        && w == W && h == H && spp == ref_spp
+        && 1 == fread( &view, sizeof(view), 1, f )
+        && !memcmp( &view, pCamera, sizeof(view))
+        && 1 == fread( aRef, W*H*sizeof(V3f), 1, f );
+    fclose( f );
+    return ok;
+}
+
+
+
+static void ref_save( const char *path, const V3f *aRef ){
+    FILE *f = fopen( path, "wb" );
+    if( !f ){
+        perror( path );
+        return;
+    }
+    fprintf( f, REF_MAGIC " %d %d %d\n", W, H, ref_spp );
+    fwrite( pCamera, sizeof(*pCamera), 1, f );
+    fwrite( aRef, W*H*sizeof(V3f), 1, f );
+    fclose( f );
+}
+
+
+
+static void ref_render( const Scene *pS, V3f *aRef ){
+    Random *r = RandomCreate();
+    for( int i=0; i<4; i++ ) r->state[i] ^= 0x5a5a5a00;
+
+    hdr_zero();
+    const uint64_t t0 = prof_now();
+    for( int s=1; s<=ref_spp; s++ ){
+        CameraFrame( pCamera, pS, r );
+        if( !(s & (s-1))) fprintf( stderr, "converge: riferimento %d/%d spp, %.1fs\n", s, ref_spp, seconds( t0 ));
+    }
+
+    const V3f *aHdr = hdr_pixels();
+    for( int i=0; i<W*H; i++ ) aRef[i] = aHdr[i] * (1.0f/ref_spp);
+    free( r );
+}
+
+
+
+static void measure_error( const V3f *aRef, int spp, double *pRmse, double *pRelmse ){
+    const V3f *aHdr = hdr_pixels();
+    const float inv = 1.0f/spp;
+    double se = 0, rel = 0;
+    for( int i=0; i<W*H; i++ ){
+        const V3f x = aHdr[i] * inv;
+        for( int c=0; c<3; c++ ){
+            const double d = x.v[c] - aRef[i].v[c];
+            se  += d*d;
+            rel += d*d / ( aRef[i].v[c]*aRef[i].v[c] + REL_EPS );
+        }
+    }
+    *pRmse   = sqrt( se / (W*H*3));
+    *pRelmse = rel / (W*H*3);
+}
+
+
+
+
+static void usage( const char *argv0 ){
+    fprintf( stderr,
+        "usage: %s [options] scene.obj...\n"
+        "  -s SPP      reference samples per pixel (default 1024)\n"
+        "  -t SECONDS  candidate render time per scene (default 10)\n"
+        "  -i SECONDS  interval between error samples (default 0.5)\n"
+        "  -l LEVELS   build the index lazily, LEVELS levels per visit\n"
+        "  -g WxH      render resolution (default %dx%d)\n"
+        "  -v          use the view saved in last.txt\n"
+        "  -o FILE     json lines output (default stdout)\n"
+        , argv0, W_DEFAULT, H_DEFAULT );
+    exit( 1 );
+}
+
+
+
+int main( int argc, char *argv[]){
+
+    FILE *out = stdout;
+
+    int opt;
+    while(( opt = getopt( argc, argv, "s:t:i:l:g:vo:" )) != -1 ){
+        switch( opt ){
+            case 's': ref_spp    = atoi( optarg ); break;
+            case 't': duration_s = atof( optarg ); break;
+            case 'i': interval_s = atof( optarg ); break;
+            case 'l': SpatialIndexLazyLevels = atoi( optarg ); break;
+            case 'g': if( 2 != sscanf( optarg, "%dx%d", &W, &H )) usage( argv[0] ); break;
+            case 'v': last_view  = true; break;
+            case 'o': assert( out = fopen( optarg, "wb" )); break;
+            default : usage( argv[0] );
+        }
+    }
+    if( optind >= argc || ref_spp < 1 || interval_s <= 0 || W < 3 || H < 3 ) usage( argv[0] );
+
+    hdr_init();
+
+    V3f *aRef;
+    assert( aRef = (V3f*)malloc( (size_t)W*H*sizeof(V3f)));
+
+    for( int a=optind; a<argc; a++ ){
+        const char *scene = argv[a];
+
+        pCamera = CameraCreate();
+        camera_setup();
+        Scene *pS = SceneConstruct( scene, &CameraEyePoint( pCamera ));
+
+        char ref_path[4096];
+        snprintf( ref_path, sizeof(ref_path), "%s.ref", scene );
+        if( !ref_load( ref_path, aRef )){
+            ref_render( pS, aRef );
+            ref_save( ref_path, aRef );
+        }
+
+        // candidato: da zero, misurando solo il tempo di render
+        Random *r = RandomCreate();
+        hdr_zero();
+        double t = 0, next = interval_s;
+        for( int spp=1; t < duration_s; spp++ ){
+            const uint64_t t0 = prof_now();
+            CameraFrame( pCamera, pS, r );
+            t += seconds( t0 );
+
+            if( t >= next || t >= duration_s ){
+                double rmse, relmse;
+                measure_error( aRef, spp, &rmse, &relmse );
+                fprintf( out, "{\"scene\":\"%s\",\"t\":%.4f,\"spp\":%d,\"rmse\":%.6g,\"relmse\":%.6g}\n"
+                    , scene, t, spp, rmse, relmse );
+                fflush( out );
+                while( next <= t ) next += interval_s;
+            }
+        }
+
+        free( r );
+        SceneDestruct( pS );
+        free( pCamera );
+    }
+
+    free( aRef );
+    if( out != stdout ) fclose( out );
+    return 0;
+}
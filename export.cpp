@@ -0,0 +1,435 @@
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <SDL.h>
+#include <globals.h>
+#include <hdr.h>
+#include <prof.h>
+#include <render.h>
+#include <perfctr.h>
+
+
+// esportazione dell'immagine, in float oltre che a 8 bit
+//
+//     ./main -o img.exr -o img.png -O 60 scena.obj
+//
+// il formato viene dall'estensione:
+//
+//     .pfm    float 32 bit RGB, radianza media per pixel
+//     .exr    OpenEXR half 16 bit, scanline non compresso
+//     .png    8 bit come a schermo: firefly_filter e tone mapping
+//
+// un %d nel nome prende il numero dello snapshot, es. img%04d.exr
+// (uno solo, con larghezza opzionale; %% per un % vero)
+// si esporta ogni -O secondi, con F12 e all'uscita
+//
+// frame() passa la media per pixel (una copia, W*H) e torna subito:
+// filtro, tone mapping, conversioni e scrittura sono su un thread a
+// parte. se il thread è ancora occupato lo snapshot aspetta il frame
+// dopo, il ciclo degli eventi non si ferma mai sul disco
+// ogni file si scrive in un .tmp poi rinominato, chi lo legge non lo
+// vede mai a metà
+
+
+
+#define EXPORT_MAX  4
+
+
+static const char             *aPaths[EXPORT_MAX];
+static int                     paths;
+static Uint32                  interval_ms;
+static Uint32                  exported_ticks;
+static bool                    requested;
+static int                     snapshot_no;
+
+// lavoro per il thread di scrittura, un solo snapshot in volo
+static std::mutex              lock;
+static std::condition_variable wake;
+static std::thread             writer;
+static std::atomic<bool>       busy;
+static bool                    quit;
+static V3f                    *MEAN;
+static V3f                    *FILTERED;
+static uint8_t                *RGB8;
+static int                     job_w, job_h, job_no;
+static float                   job_expo;
+
+
+
+
+// formati ---------------------------------------------------------------------
+
+static void put( FILE *f, const void *p, size_t n ){
+    if( n ) fwrite( p, n, 1, f );
+}
+
+static void put32( FILE *f, uint32_t v ){ put( f, &v, 4 ); }
+static void put64( FILE *f, uint64_t v ){ put( f, &v, 8 ); }
+
+
+
+static void write_pfm( FILE *f, const V3f *aIn, int w, int h ){
+    // scala negativa: little endian; righe dal basso
+    fprintf( f, "PF\n%d %d\n-1.0\n", w, h );
+    float *row;
+    assert( row = (float*)malloc( w*3*sizeof(float)));
+    for( int y=h-1; y>=0; y-- ){
+        for( int x=0; x<w; x++ ){
+            const V3f &c = aIn[y*w + x];
+            row[x*3+0] = c.R();
+            row[x*3+1] = c.G();
+            row[x*3+2] = c.B();
+        }
+        put( f, row, w*3*sizeof(float));
+    }
+    free( row );
+}
+
+
+
+static uint16_t half( float v ){
+    // al pari più vicino, oltre 65504 infinito, denormali compresi
+    uint32_t x;
+    memcpy( &x, &v, 4 );
+    const uint16_t sign = x >> 16 & 0x8000;
+    x &= 0x7fffffff;
+
+    if( x >= 0x7f800000 ) return sign | 0x7c00 | ( x > 0x7f800000 ? 0x200 : 0 );
+    if( x >= 0x477ff000 ) return sign | 0x7c00;
+    if( x >= 0x38800000 ){
+        // normale: si riporta l'esponente e si arrotondano 13 bit di mantissa
+        uint32_t h = ( x - 0x38000000 ) >> 13;
+        const uint32_t rem = x & 0x1fff;
+        h += rem > 0x1000 || ( rem == 0x1000 && ( h & 1 ));
+        return sign | h;
+    }
+    if( x < 0x33000000 ) return sign;
+    // denormale: mantissa intera spostata sotto 2^-14
+    const uint32_t m = ( x & 0x7fffff ) | 0x800000;
+    const int      s = 126 - ( x >> 23 );
+    uint32_t h = m >> s;
+    const uint32_t rem = m & (( 1u << s ) - 1 );
+    const uint32_t mid = 1u << ( s-1 );
+    h += rem > mid || ( rem == mid && ( h & 1 ));
+    return sign | h;
+}
+
+
+
+static void exr_attr( FILE *f, const char *name, const char *type, const void *p, uint32_t n ){
+    put( f, name, strlen( name ) + 1 );
+    put( f, type, strlen( type ) + 1 );
+    put32( f, n );
+    put( f, p, n );
+}
+
+
+
+static void write_exr( FILE *f, const V3f *aIn, int w, int h ){
+    // un'immagine scanline, una riga per blocco, canali in ordine alfabetico
+    put32( f, 20000630 );
+    put32( f, 2 );
+
+    uint8_t chlist[3*18+1], *c = chlist;
+    for( const char *name = "BGR"; *name; name++ ){
+        const int32_t half_type = 1, sampling = 1;
+        *c++ = *name;
+        *c++ = 0;
+        memcpy( c, &half_type, 4 ); c += 4;
+        memset( c, 0, 4 );          c += 4;    // pLinear, riservati
+        memcpy( c, &sampling, 4 );  c += 4;
+        memcpy( c, &sampling, 4 );  c += 4;
+    }
+    *c = 0;
+    const int32_t box[4] = { 0, 0, w-1, h-1 };
+    const uint8_t none = 0;
+    const float   one = 1, center[2] = { 0, 0 };
+
+    exr_attr( f, "channels",           "chlist",      chlist, sizeof(chlist));
+    exr_attr( f, "compression",        "compression", &none,  1 );
+    exr_attr( f, "dataWindow",         "box2i",       box,    sizeof(box));
+    exr_attr( f, "displayWindow",      "box2i",       box,    sizeof(box));
+    exr_attr( f, "lineOrder",          "lineOrder",   &none,  1 );
+    exr_attr( f, "pixelAspectRatio",   "float",       &one,   4 );
+    exr_attr( f, "screenWindowCenter", "v2f",         center, sizeof(center));
+    exr_attr( f, "screenWindowWidth",  "float",       &one,   4 );
+    put( f, &none, 1 );
+
+    // tabella degli offset: i blocchi hanno tutti la stessa dimensione
+    const uint32_t line_bytes = w*3*sizeof(uint16_t);
+    const uint64_t first = ftell( f ) + (uint64_t)h*8;
+    for( int y=0; y<h; y++ ) put64( f, first + (uint64_t)y*( 8 + line_bytes ));
+
+    uint16_t *line;
+    assert( line = (uint16_t*)malloc( line_bytes ));
+    for( int y=0; y<h; y++ ){
+        for( int x=0; x<w; x++ ){
+            const V3f &p = aIn[y*w + x];
+            line[x]       = half( p.B());
+            line[w + x]   = half( p.G());
+            line[2*w + x] = half( p.R());
+        }
+        put32( f, y );
+        put32( f, line_bytes );
+        put( f, line, line_bytes );
+    }
+    free( line );
+}
+
+
+
+static uint32_t crc( uint32_t c, const uint8_t *p, size_t n ){
+    static uint32_t table[256];
+    if( !table[1] ){
+        for( uint32_t i=0; i<256; i++ ){
+            uint32_t t = i;
+            for( int k=0; k<8; k++ ) t = t & 1 ? 0xedb88320 ^ ( t >> 1 ) : t >> 1;
+            table[i] = t;
+        }
+    }
+    c = ~c;
+    while( n-- ) c = table[( c ^ *p++ ) & 0xff] ^ ( c >> 8 );
+    return ~c;
+}
+
+
+
+static void png_chunk( FILE *f, const char *type, const uint8_t *p, uint32_t n ){
+    const uint8_t len[4] = { (uint8_t)(n >> 24), (uint8_t)(n >> 16), (uint8_t)(n >> 8), (uint8_t)n };
+    put( f, len, 4 );
+    put( f, type, 4 );
+    put( f, p, n );
+    const uint32_t c = crc( crc( 0, (const uint8_t*)type, 4 ), p, n );
+    const uint8_t be[4] = { (uint8_t)(c >> 24), (uint8_t)(c >> 16), (uint8_t)(c >> 8), (uint8_t)c };
+    put( f, be, 4 );
+}
+
+
+
+static void write_png( FILE *f, const uint8_t *aRGB8, int w, int h ){
+    // deflate senza compressione (blocchi stored): niente zlib, e a
+    // queste dimensioni il file resta piccolo
+    const size_t raw_bytes = (size_t)h*( 1 + w*3 );
+    const size_t blocks    = ( raw_bytes + 65534 ) / 65535;
+    const size_t zbytes    = 2 + blocks*5 + raw_bytes + 4;
+
+    uint8_t *raw, *z;
+    assert( raw = (uint8_t*)malloc( raw_bytes ));
+    assert( z   = (uint8_t*)malloc( zbytes ));
+
+    // filtro 0 a inizio riga
+    for( int y=0; y<h; y++ ){
+        uint8_t *r = raw + (size_t)y*( 1 + w*3 );
+        r[0] = 0;
+        memcpy( r+1, aRGB8 + (size_t)y*w*3, w*3 );
+    }
+
+    uint8_t *p = z;
+    *p++ = 0x78;
+    *p++ = 0x01;
+    uint32_t a = 1, b = 0;
+    for( size_t i=0; i<raw_bytes; i+=65535 ){
+        const uint16_t n = raw_bytes - i < 65535 ? raw_bytes - i : 65535;
+        *p++ = i + n == raw_bytes;
+        *p++ = n;          *p++ = n >> 8;
+        *p++ = ~n;         *p++ = (uint16_t)~n >> 8;
+        memcpy( p, raw + i, n );
+        p += n;
+        for( int k=0; k<n; k++ ){
+            a = ( a + raw[i+k] ) % 65521;
+            b = ( b + a ) % 65521;
+        }
+    }
+    const uint32_t adler = b << 16 | a;
+    *p++ = adler >> 24; *p++ = adler >> 16; *p++ = adler >> 8; *p++ = adler;
+
+    const uint8_t ihdr[13] = {
+        (uint8_t)(w >> 24), (uint8_t)(w >> 16), (uint8_t)(w >> 8), (uint8_t)w,
+        (uint8_t)(h >> 24), (uint8_t)(h >> 16), (uint8_t)(h >> 8), (uint8_t)h,
+        8, 2, 0, 0, 0 };    // 8 bit, RGB
+    put( f, "\x89PNG\r\n\x1a\n", 8 );
+    png_chunk( f, "IHDR", ihdr, sizeof(ihdr));
+    png_chunk( f, "IDAT", z, zbytes );
+    png_chunk( f, "IEND", 0, 0 );
+
+    free( z );
+    free( raw );
+}
+
+
+
+
+// thread di scrittura ---------------------------------------------------------
+
+static const char *extension( const char *path ){
+    const char *dot = strrchr( path, '.' );
+    return dot ? dot : "";
+}
+
+
+
+static bool numbering_ok( const char *path ){
+    // il nome fa da formato di snprintf: al più un %d, con zeri e
+    // larghezza (%04d), e %% per un % vero; nient'altro
+    int numbers = 0;
+    for( const char *p = path; ( p = strchr( p, '%' )); p++ ){
+        if( p[1] == '%' ){ p++; continue; }
+        p++;
+        if( *p == '0' ) p++;
+        while( *p >= '0' && *p <= '9' ) p++;
+        if( *p != 'd' || ++numbers > 1 ) return false;
+    }
+    return true;
+}
+
+
+
+static void write_all(){
+    PROF("export");
+    const Uint32 t0 = SDL_GetTicks();
+
+    // l'8 bit solo se serve: filtro e tone mapping come hdr_to_sdl()
+    bool rgb8 = false;
+    for( int i=0; i<paths; i++ ){
+        if( strcasecmp( extension( aPaths[i] ), ".png" ) || rgb8 ) continue;
+        firefly_filter( FILTERED, MEAN );
+        tonemap( RGB8, FILTERED, job_expo );
+        rgb8 = true;
+    }
+
+    for( int i=0; i<paths; i++ ){
+        char path[4096], tmp[4096+4];
+        snprintf( path, sizeof(path), aPaths[i], job_no );
+        snprintf( tmp, sizeof(tmp), "%s.tmp", path );
+
+        FILE *f = fopen( tmp, "wb" );
+        if( !f ){
+            perror( tmp );
+            continue;
+        }
+        const char *ext = extension( path );
+        if( !strcasecmp( ext, ".pfm" )) write_pfm( f, MEAN, job_w, job_h );
+        if( !strcasecmp( ext, ".exr" )) write_exr( f, MEAN, job_w, job_h );
+        if( !strcasecmp( ext, ".png" )) write_png( f, RGB8, job_w, job_h );
+
+        if( ferror( f ) | fclose( f ) || rename( tmp, path )){
+            perror( path );
+            remove( tmp );
+            continue;
+        }
+        fprintf( stderr, "export: %s\n", path );
+    }
+    fprintf( stderr, "export: snapshot %d in %u ms\n", job_no, SDL_GetTicks()-t0 );
+}
+
+
+
+static void work(){
+    // filtro e tone mapping qui non sono del frame: fuori dai contatori
+    perfctr_muted = true;
+    std::unique_lock<std::mutex> lk( lock );
+    while( 1 ){
+        while( !busy && !quit ) wake.wait( lk );
+        if( busy ){
+            lk.unlock();
+            write_all();
+            lk.lock();
+            busy = false;
+            wake.notify_all();
+        }
+        if( quit ) return;
+    }
+}
+
+
+
+
+// API -------------------------------------------------------------------------
+
+bool export_add( const char *path ) // HEADER
+{
+    // falso se il formato non è noto, se il nome ha % diversi da un
+    // solo %d, o ci sono già EXPORT_MAX file
+    const char *ext = extension( path );
+    if( strcasecmp( ext, ".pfm" ) && strcasecmp( ext, ".exr" ) && strcasecmp( ext, ".png" )) return false;
+    if( !numbering_ok( path )) return false;
+    if( paths == EXPORT_MAX ) return false;
+    aPaths[paths++] = path;
+    return true;
+}
+
+
+
+void export_start( float interval_s ) // HEADER
+{
+    // dopo hdr_init(): i buffer sono della risoluzione scelta
+    if( !paths ) return;
+    interval_ms    = interval_s * 1000;
+    exported_ticks = SDL_GetTicks();
+    const size_t n = (size_t)W*H;
+    assert( MEAN     = (V3f*)malloc( n*sizeof(V3f)));
+    assert( FILTERED = (V3f*)malloc( n*sizeof(V3f)));
+    assert( RGB8     = (uint8_t*)malloc( n*3 ));
+    writer = std::thread( work );
+}
+
+
+
+void export_request() // HEADER
+{
+    requested = true;
+}
+
+
+
+void export_frame() // HEADER
+{
+    // da frame(), dopo hdr_snapshot()
+    if( !paths ) return;
+    const Uint32 now = SDL_GetTicks();
+    if( !requested && !( interval_ms && now - exported_ticks >= interval_ms )) return;
+    if( busy ) return;      // ci si riprova al prossimo frame
+
+    hdr_mean( MEAN );
+    job_w    = W;
+    job_h    = H;
+    job_expo = expo;
+    job_no   = snapshot_no++;
+
+    requested      = false;
+    exported_ticks = now;
+    std::lock_guard<std::mutex> lk( lock );
+    busy = true;
+    wake.notify_all();
+}
+
+
+
+void export_stop() // HEADER
+{
+    // ultimo snapshot, aspettando il disco: si sta uscendo
+    if( !paths ) return;
+    {
+        std::unique_lock<std::mutex> lk( lock );
+        while( busy ) wake.wait( lk );
+    }
+    render_pause();
+    hdr_snapshot();
+    render_resume();
+    requested = true;
+    export_frame();
+    {
+        std::lock_guard<std::mutex> lk( lock );
+        quit = true;
+        wake.notify_all();
+    }
+    writer.join();
+}
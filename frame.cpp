@@ -5,32 +5,65 @@
 #include <main.h>
 #include <loop.h>
 #include <globals.h>
+#include <prof.h>
+#include <Camera.h>
+#include <render.h>
+#include <export.h>
+#include <stream.h>
+#include <stats.h>
+#include <perfctr.h>
 
+// HEADERBEG
+struct Camera;
+// HEADEREND
 
 
 
 
 
 
-void frame(){   // HEADER
 
-    pCamera->viewPosition  = V3f( camera.t.x, camera.t.y, camera.t.z );
-    pCamera->viewDirection = V3f( camera.z.x, camera.z.y, camera.z.z );
-    pCamera->right         = V3f( camera.x.x, camera.x.y, camera.x.z );
-    pCamera->up            = V3f( camera.y.x, camera.y.y, camera.y.z );
+void frame_camera( Camera *pC ){   // HEADER
+    // dalla camera di navigazione a quella di minilight
+    pC->viewPosition  = V3f( camera.t.x, camera.t.y, camera.t.z );
+    pC->viewDirection = V3f( camera.z.x, camera.z.y, camera.z.z );
+    pC->right         = V3f( camera.x.x, camera.x.y, camera.x.z );
+    pC->up            = V3f( camera.y.x, camera.y.y, camera.y.z );
+}
+
+
+
+
+
+// niente più budget del frame (frame_passes, medie mobili di passata e
+// presentazione): il render accumula di continuo sul suo thread, quindi
+// in un intervallo -f entrano da sole tutte le passate che ci stanno, e
+// la presentazione non toglie tempo al render. -f resta il tempo del
+// frame, ma decide solo quando si mostra e si applica la camera
+
+void frame(){   // HEADER
 
 //    CameraPrint(pCamera);
 //    exit(1);
 
-    CameraFrame( pCamera, pScene, pRandom );
+    // il render gira su un altro thread: a lavoro fermo si copia solo
+    // l'accumulo e si raccolgono i contatori per thread, filtro, tone
+    // mapping, upload e present vanno in parallelo alla passata successiva
+    render_pause();
+    const int n = samples = hdr_snapshot();
+    stats_frame();
+    perfctr_frame();
+    render_resume();
+    export_frame();
 //    hdr_to_sdl( expo / samples );
     hdr_to_sdl();
+    stream_frame();
 
     // progress bar
     SDL_SetRenderDrawColor( renderer, 255, 255, 255, 0 );
     SDL_Rect r;
     r.h = 2;
-    r.w = samples;
+    r.w = n;
     r.x = 0;
     r.y = WH-r.h;
     SDL_RenderFillRect( renderer, &r );
@@ -44,6 +77,7 @@ void frame(){   // HEADER
     if( speed_mult >= SPEED_MULT_2 ){ r.x+=5; SDL_RenderCopy( renderer, play_icon, NULL, &r ); }
     if( speed_mult >= SPEED_MULT_3 ){ r.x+=5; SDL_RenderCopy( renderer, play_icon, NULL, &r ); }
 
+    PROF("SDL_RenderPresent");
     SDL_RenderPresent( renderer );
 }
 
@@ -9,9 +9,12 @@
 #include <Scene.h>
 #include <stdint.h>
 
-#define W         320
-#define H         180
-#define PIXELATE  3
+#define W_DEFAULT         320
+#define H_DEFAULT         180
+#define PIXELATE_DEFAULT  3
+
+extern int W, H;        // risoluzione del render, da -g
+extern int PIXELATE;    // pixel della finestra per pixel del render, da -z
 
 #define WW (W*PIXELATE)
 #define WH (H*PIXELATE)
@@ -22,13 +25,23 @@
 #define SPEED_MULT_2 10
 #define SPEED_MULT_3 100
 
+#define PREVIEW_HOLD_MS 200     // anteprima anche un po' dopo l'ultimo movimento
+#define LOOP_WAIT_MS    4       // attesa massima dell'input nel ciclo degli eventi
+
 // HEADEREND
 
 
+int   W        = W_DEFAULT;
+int   H        = H_DEFAULT;
+int   PIXELATE = PIXELATE_DEFAULT;
+
 M34   camera;     // HEADER
 float expo;       // HEADER
 int   samples;    // HEADER
 int   speed_mult; // HEADER
+int   preview_step;   // HEADER    lato dei blocchi in anteprima, 0 disattiva
+bool  temporal;       // HEADER    riproiezione dell'accumulo quando la camera si muove
+float frame_budget_ms;    // HEADER    intervallo tra i frame mostrati, 0 a ogni passata; non è un budget di passate
 
 SDL_Renderer *renderer;    // HEADER
 SDL_Texture  *framebuffer; // HEADER
@@ -1,15 +1,51 @@
 
 #include <math.h>
+#include <stdio.h>   // HEADER
 #include <stdlib.h>
 #include <assert.h>
-#include <stdint.h>
+#include <string.h>
+#include <stdint.h>  // HEADER
 #include <globals.h>
+#include <prof.h>
+#include <perfctr.h>
+#include <huge.h>
 #include <V3f.h>  // HEADER 
 
 
-typedef V3f HDR_PIXMAP[H][W];
+// tutti i buffer sono W*H per righe, fatti da hdr_init() a risoluzione
+// scelta, e riusati frame dopo frame: niente immagini sullo stack
+#define PX( X, Y ) ((Y)*W + (X))
 
-HDR_PIXMAP HDR;
+static V3f     *HDR;            // accumulo
+
+// per la riproiezione temporale: campioni e primo impatto per pixel
+// HIT è in coordinate mondo, o la direzione del raggio se SKY
+static float   *COUNT;
+static V3f     *HIT;
+static uint8_t *SKY;
+static uint8_t *REPROJECTED;    // storia riproiettata, da validare al prossimo campione
+static V3f      reprojected_eye;
+
+// appoggio di hdr_reproject()
+static V3f     *R_SUM, *R_HIT;
+static float   *R_COUNT, *R_DEPTH;
+static uint8_t *R_SKY;
+
+// copia per la visualizzazione, e i passi di hdr_to_sdl()
+static V3f     *HDR_SHOW;
+static float   *COUNT_SHOW;
+static V3f     *MEAN, *FILTERED;
+static uint8_t *RGB8;
+
+static int      buffers_w, buffers_h;
+
+// HEADERBEG
+struct Camera;
+// HEADEREND
+
+// un campione che cade a più di questa frazione della distanza dall'occhio
+// dal vecchio primo impatto è una disocclusione
+#define REPROJECT_TOLERANCE 0.02
 
 
 /* constants ---------------------------------------------------------------- */
@@ -41,7 +77,7 @@ static float calculateToneMapping( const float divider )
         {
             for( int x=0;  x<W; ++x )
             {
-                const float Y = HDR[y][x].dot( scale );
+                const float Y = HDR[PX(x,y)].dot( scale );
                 /* clamp luminance to a perceptual minimum */
                 sumOfLogs += log10( Y > 1e-4 ? Y : 1e-4 );
             }
@@ -66,13 +102,77 @@ static float calculateToneMapping( const float divider )
 
 
 
-void hdr_accum( int x, int y, const V3f radiance ) // HEADER
+void hdr_accum( int x, int y, const V3f radiance, const V3f hit, bool sky ) // HEADER
 {
     if( x <  0 ) return;
     if( y <  0 ) return;
     if( x >= W ) return;
     if( y >= H ) return;
-    HDR[y][x] = HDR[y][x] + radiance;
+
+    // primo campione dopo una riproiezione: se vede un'altra superficie
+    // la storia è di qualcos'altro, si butta
+    if( REPROJECTED[PX(x,y)] ){
+        REPROJECTED[PX(x,y)] = 0;
+        const V3f moved = hit - HIT[PX(x,y)];
+        const V3f seen  = hit - reprojected_eye;
+        const bool same = SKY[PX(x,y)] ? sky : !sky &&
+            moved.dot( moved ) < REPROJECT_TOLERANCE*REPROJECT_TOLERANCE * seen.dot( seen );
+        if( !same ){
+            HDR[PX(x,y)]   = V3f::ZERO;
+            COUNT[PX(x,y)] = 0;
+        }
+    }
+
+    HDR[PX(x,y)]   = HDR[PX(x,y)] + radiance;
+    COUNT[PX(x,y)] += 1;
+    HIT[PX(x,y)]   = hit;
+    SKY[PX(x,y)]   = sky;
+}
+
+
+
+
+
+static void *buffer( void *p, size_t bytes ){
+    // allineato alla linea di cache: le righe si dividono tra i thread
+    free( p );
+    assert( !posix_memalign( &p, 64, bytes ));
+    return p;
+}
+
+
+
+void hdr_init() // HEADER
+{
+    // dopo aver scelto W e H, e di nuovo se cambiano (a render fermo)
+    if( HDR && W == buffers_w && H == buffers_h ) return;
+    const size_t n = (size_t)W*H;
+
+    // l'accumulo è letto e scritto a ogni campione, su pagine grandi con -H
+    huge_free( HDR );
+    HDR = (V3f*)huge_calloc( n*sizeof(V3f), "hdr" );
+
+    COUNT       = (float*)  buffer( COUNT,       n*sizeof(float));
+    HIT         = (V3f*)    buffer( HIT,         n*sizeof(V3f));
+    SKY         = (uint8_t*)buffer( SKY,         n );
+    REPROJECTED = (uint8_t*)buffer( REPROJECTED, n );
+
+    R_SUM       = (V3f*)    buffer( R_SUM,       n*sizeof(V3f));
+    R_HIT       = (V3f*)    buffer( R_HIT,       n*sizeof(V3f));
+    R_COUNT     = (float*)  buffer( R_COUNT,     n*sizeof(float));
+    R_DEPTH     = (float*)  buffer( R_DEPTH,     n*sizeof(float));
+    R_SKY       = (uint8_t*)buffer( R_SKY,       n );
+
+    HDR_SHOW    = (V3f*)    buffer( HDR_SHOW,    n*sizeof(V3f));
+    COUNT_SHOW  = (float*)  buffer( COUNT_SHOW,  n*sizeof(float));
+    MEAN        = (V3f*)    buffer( MEAN,        n*sizeof(V3f));
+    FILTERED    = (V3f*)    buffer( FILTERED,    n*sizeof(V3f));
+    RGB8        = (uint8_t*)buffer( RGB8,        n*3 );
+
+    buffers_w = W;
+    buffers_h = H;
+    hdr_zero();
+    bzero( COUNT_SHOW, n*sizeof(float));
 }
 
 
@@ -81,7 +181,139 @@ void hdr_accum( int x, int y, const V3f radiance ) // HEADER
 
 void hdr_zero() // HEADER
 {
-    bzero(HDR,sizeof(HDR));
+    bzero((void*)HDR,(size_t)W*H*sizeof(V3f));
+    bzero(COUNT,(size_t)W*H*sizeof(float));
+    bzero(REPROJECTED,(size_t)W*H);
+}
+
+
+
+
+
+float hdr_reproject( const Camera *pNew ) // HEADER
+{
+    // riproiezione in avanti: ogni pixel accumulato va dove il suo primo
+    // impatto cade nella nuova vista, col più vicino che vince (z-buffer)
+    // dove non arriva niente (disocclusioni, bordi, crepe) si riparte da zero
+    // restituisce la media dei campioni sopravvissuti
+    //
+    // vale perché le superfici sono diffuse ideali: la radianza verso
+    // l'occhio non dipende dalla direzione
+
+    PROF("hdr_reproject");
+
+    V3f     *sum   = R_SUM,   *hit   = R_HIT;
+    float   *count = R_COUNT, *depth = R_DEPTH;
+    uint8_t *sky   = R_SKY;
+
+    bzero( count, (size_t)W*H*sizeof(float));
+    for( int i=0; i<W*H; i++ ) depth[i] = INFINITY;
+
+    const double tanView = tan( pNew->viewAngle * 0.5 );
+    double total = 0;
+
+    for( int y=0; y<H; y++ ){
+        for( int x=0; x<W; x++ ){
+            if( COUNT[PX(x,y)] <= 0 ) continue;
+
+            // il cielo è all'infinito: conta solo la direzione
+            const V3f v = SKY[PX(x,y)] ? HIT[PX(x,y)] : HIT[PX(x,y)] - pNew->viewPosition;
+            const float z = v.dot( pNew->viewDirection );
+            if( z <= 0 ) continue;
+
+            // inverso del rasterizer di CameraFrame
+            const float cx = v.dot( pNew->right ) / z;
+            const float cy = -v.dot( pNew->up ) / z;
+            const int   nx = floor(( cx / tanView + 1.0 ) * W * 0.5 );
+            const int   ny = floor(( cy / ( tanView * H / W ) + 1.0 ) * H * 0.5 );
+            if( nx < 0 || nx >= W || ny < 0 || ny >= H ) continue;
+
+            const float d = SKY[PX(x,y)] ? INFINITY : z;
+            if( count[PX(nx,ny)] > 0 && d >= depth[PX(nx,ny)] ) continue;
+
+            sum[PX(nx,ny)]   = HDR[PX(x,y)];
+            count[PX(nx,ny)] = COUNT[PX(x,y)];
+            hit[PX(nx,ny)]   = HIT[PX(x,y)];
+            sky[PX(nx,ny)]   = SKY[PX(x,y)];
+            depth[PX(nx,ny)] = d;
+        }
+    }
+
+    for( int y=0; y<H; y++ ){
+        for( int x=0; x<W; x++ ){
+            HDR[PX(x,y)]         = count[PX(x,y)] > 0 ? sum[PX(x,y)] : V3f::ZERO;
+            COUNT[PX(x,y)]       = count[PX(x,y)];
+            HIT[PX(x,y)]         = hit[PX(x,y)];
+            SKY[PX(x,y)]         = sky[PX(x,y)];
+            REPROJECTED[PX(x,y)] = count[PX(x,y)] > 0;
+            total += count[PX(x,y)];
+        }
+    }
+    reprojected_eye = pNew->viewPosition;
+
+    return total / (W*H);
+}
+
+
+
+
+
+// copia dell'accumulo per la visualizzazione: il render riparte subito
+// sul buffer principale, filtro, tone mapping e upload lavorano su questa
+
+float hdr_snapshot() // HEADER
+{
+    PROF("hdr_snapshot");
+    memcpy( HDR_SHOW, HDR, (size_t)W*H*sizeof(V3f));
+    memcpy( COUNT_SHOW, COUNT, (size_t)W*H*sizeof(float));
+
+    // media dei campioni per pixel: le passate possono essere interrotte
+    // e la riproiezione lascia conteggi diversi da pixel a pixel
+    double total = 0;
+    for( int y=0; y<H; y++ ) for( int x=0; x<W; x++ ) total += COUNT[PX(x,y)];
+    return total / (W*H);
+}
+
+
+
+
+
+// stato per pixel dell'accumulo, per i checkpoint: quanto basta a
+// continuare, riproiezione compresa, come se non ci si fosse mai fermati
+
+bool hdr_write( FILE *f ) // HEADER
+{
+    const size_t n = (size_t)W*H;
+    return 1 == fwrite( HDR,         n*sizeof(V3f),   1, f )
+        && 1 == fwrite( COUNT,       n*sizeof(float), 1, f )
+        && 1 == fwrite( HIT,         n*sizeof(V3f),   1, f )
+        && 1 == fwrite( SKY,         n,               1, f )
+        && 1 == fwrite( REPROJECTED, n,               1, f )
+        && 1 == fwrite( &reprojected_eye, sizeof(V3f), 1, f );
+}
+
+
+
+bool hdr_read( FILE *f ) // HEADER
+{
+    // a metà lettura il buffer è sporco: chi fallisce deve azzerare
+    const size_t n = (size_t)W*H;
+    return 1 == fread( HDR,         n*sizeof(V3f),   1, f )
+        && 1 == fread( COUNT,       n*sizeof(float), 1, f )
+        && 1 == fread( HIT,         n*sizeof(V3f),   1, f )
+        && 1 == fread( SKY,         n,               1, f )
+        && 1 == fread( REPROJECTED, n,               1, f )
+        && 1 == fread( &reprojected_eye, sizeof(V3f), 1, f );
+}
+
+
+
+
+
+const V3f *hdr_pixels() // HEADER
+{
+    // accumulo grezzo, W*H somme di campioni
+    return HDR;
 }
 
 
@@ -90,34 +322,45 @@ void hdr_zero() // HEADER
 
 
 
-void firefly_filter( HDR_PIXMAP& out, HDR_PIXMAP& in ){
+// kernels su buffer W*H, esportati anche per ubench
 
-    bzero(out,sizeof(out));
+void firefly_filter( V3f *pOut, const V3f *pIn ){ // HEADER
 
-#pragma omp parallel for
+    PROF("firefly_filter");
+
+    bzero((void*)pOut,(size_t)W*H*sizeof(V3f));
+
+    const bool counted = !perfctr_muted;
+#pragma omp parallel
+    {
+    PROF("firefly_filter rows");
+    PERFCTR_IF( PERFCTR_FIREFLY, counted );
+#pragma omp for nowait
     for( int y=1; y<H-1 ; y++ ){
+        const V3f *in[3] = { pIn+PX(0,y-1), pIn+PX(0,y), pIn+PX(0,y+1) };
+        V3f *out = pOut+PX(0,y);
         for( int x=1; x<W-1 ; x++ ){
 
             // elimina bene le fireflies
             // qualche artefatto nelle zone d'ombra
             // ma niente di che
-            V3f avg = in[y-1][x-1]+in[y-1][x-0]+in[y-1][x+1]+
-                      in[y-0][x-1]       +      in[y-0][x+1]+
-                      in[y+1][x-1]+in[y+1][x-0]+in[y+1][x+1];
+            V3f avg = in[0][x-1]+in[0][x-0]+in[0][x+1]+
+                      in[1][x-1]       +      in[1][x+1]+
+                      in[2][x-1]+in[2][x-0]+in[2][x+1];
             avg = avg*(2.0/8);
 
-//            V3f avg =              in[y-1][x-0]+
-//                      in[y-0][x-1]       +      in[y-0][x+1]+
-//                                   in[y+1][x-0];
+//            V3f avg =              in[0][x-0]+
+//                      in[1][x-1]       +      in[1][x+1]+
+//                                   in[2][x-0];
 //            avg = avg*(2.0/4);
 
 //            V3f avg = in[y][x-1]+in[y][x+1];
 //            avg = avg*(2.0/2);
 
-            float a = in[y][x].dot(in[y][x]);
+            float a = in[1][x].dot(in[1][x]);
             float b = avg.dot(avg);
 
-            out[y][x] = (a > b ? avg : in[y][x]);
+            out[x] = (a > b ? avg : in[1][x]);
 
 //            // bloom
 //            // l'energia dei pixel leaka nei limitrofi
@@ -135,6 +378,7 @@ void firefly_filter( HDR_PIXMAP& out, HDR_PIXMAP& in ){
 
         }
     }    
+    }
 }
 
 
@@ -147,21 +391,23 @@ void firefly_filter( HDR_PIXMAP& out, HDR_PIXMAP& in ){
 
 
 
-void hdr_to_sdl(){    // HEADER
-
-    uint8_t RGB8[H][W][3];
-    HDR_PIXMAP HDR2;
+void tonemap( uint8_t *pRGB8, const V3f *pIn, float isamples ){  // HEADER
 
-    firefly_filter( HDR2, HDR );
 
-    float isamples = expo/samples;
-    
-#pragma omp parallel for
+    PROF("tonemap");
+    const bool counted = !perfctr_muted;
+#pragma omp parallel
+    {
+    PROF("tonemap rows");
+    PERFCTR_IF( PERFCTR_TONEMAP, counted );
+#pragma omp for nowait
     for( int y=0; y<H ; y++ ){
+        const V3f *in  = pIn+PX(0,y);
+        uint8_t   *out = pRGB8+PX(0,y)*3;
         for( int x=0; x<W ; x++ ){
 
             // avg
-            V3f color = HDR2[y][x] * isamples;
+            V3f color = in[x] * isamples;
 
 //            // max
 //            V3f color;
@@ -179,9 +425,9 @@ void hdr_to_sdl(){    // HEADER
             // Reinhard tone mapping - srgb
             V3f d = color + V3f::ONE;
             color = V3f( color.R()/d.R(), color.G()/d.G(), color.B()/d.B());
-            RGB8[y][x][0]=pow(color.R(),GAMMA_ENCODE)*255;
-            RGB8[y][x][1]=pow(color.G(),GAMMA_ENCODE)*255;
-            RGB8[y][x][2]=pow(color.B(),GAMMA_ENCODE)*255;
+            out[x*3+0]=pow(color.R(),GAMMA_ENCODE)*255;
+            out[x*3+1]=pow(color.G(),GAMMA_ENCODE)*255;
+            out[x*3+2]=pow(color.B(),GAMMA_ENCODE)*255;
 
 //            // abs tone mapping
 //            float d = sqrtf(color%color)+1;
@@ -196,8 +442,50 @@ void hdr_to_sdl(){    // HEADER
             // alla curva della correzione gamma
         }
     }
+    }
+}
+
+
+
+
+
+
+
+void hdr_mean( V3f *pOut ){    // HEADER
+    // radianza media per pixel dalla copia di hdr_snapshot(), W*H
+    // i conteggi non sono uniformi dopo una riproiezione
+    for( int i=0; i<W*H; i++ ){
+        pOut[i] = COUNT_SHOW[i] > 0 ? HDR_SHOW[i] * ( 1.0f / COUNT_SHOW[i] ) : V3f::ZERO;
+    }
+}
+
+
+
+
+
+
+
+const uint8_t *hdr_rgb8(){    // HEADER
+    // l'ultima immagine di hdr_to_sdl(), W*H RGB, quella a schermo
+    return RGB8;
+}
+
+
+
+
+
+
+
+void hdr_to_sdl(){    // HEADER
+
+    // dalla copia di hdr_snapshot(), in parallelo al render
+    hdr_mean( MEAN );
+
+    firefly_filter( FILTERED, MEAN );
+    tonemap( RGB8, FILTERED, expo );
 
-    SDL_UpdateTexture( framebuffer , NULL, RGB8, W*sizeof(RGB8[0][0]));
+    PROF("SDL_UpdateTexture");
+    SDL_UpdateTexture( framebuffer , NULL, RGB8, W*3 );
     SDL_RenderCopy( renderer, framebuffer , NULL , NULL );
 }
 
@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <mutex>
+#include <vector>
+
+
+// memoria su pagine da 2MB per i blocchi grossi (-H)
+//
+// triangoli e nodi dell'indice si leggono a salti durante il traversal,
+// e con qualche GB di scena le pagine da 4K finiscono il TLB
+// in ordine si prova:
+//
+//     hugetlb    mmap MAP_HUGETLB, pagine riservate (vm.nr_hugepages)
+//     thp        mmap allineata a 2MB + madvise(MADV_HUGEPAGE), se il
+//                kernel ha le transparent huge pages in always o madvise
+//     malloc     altrimenti, o sotto HUGE_MIN, o senza -H
+//
+// ogni blocco riporta su stderr la strada presa
+// i blocchi huge sono in un registro: huge_realloc() e huge_free()
+// accettano anche puntatori di malloc, quindi chi li usa non deve sapere
+
+
+
+#define HUGE_PAGE  (2u<<20)
+#define HUGE_MIN   (1u<<20)     // sotto, mezza pagina o più andrebbe sprecata
+
+#define ROUND_UP( N, A ) (((N) + (A) - 1) / (A) * (A))
+
+
+bool huge_pages;    // HEADER
+
+struct HUGE_BLOCK {
+    void  *p;
+    size_t bytes;       // mappati
+};
+
+static std::mutex              blocks_lock;
+static std::vector<HUGE_BLOCK> blocks;
+
+
+
+
+static bool thp_usable(){
+    // "always [madvise] never": va bene tutto tranne [never]
+    char s[128] = "";
+    FILE *f = fopen( "/sys/kernel/mm/transparent_hugepage/enabled", "r" );
+    if( !f ) return false;
+    if( !fgets( s, sizeof(s), f )) s[0] = 0;
+    fclose( f );
+    return s[0] && !strstr( s, "[never]" );
+}
+
+
+
+static void *map_hugetlb( size_t bytes ){
+    void *p = mmap( 0, bytes, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0 );
+    return p == MAP_FAILED ? 0 : p;
+}
+
+
+
+static void *map_thp( size_t bytes ){
+    // mappa un po' più grande, e taglia testa e coda per allineare a 2MB
+    const size_t span = bytes + HUGE_PAGE;
+    char *p = (char*)mmap( 0, span, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0 );
+    if( p == MAP_FAILED ) return 0;
+    char *a = (char*)ROUND_UP( (uintptr_t)p, HUGE_PAGE );
+    if( a > p ) munmap( p, a - p );
+    if( p + span > a + bytes ) munmap( a + bytes, p + span - ( a + bytes ));
+    madvise( a, bytes, MADV_HUGEPAGE );
+    return a;
+}
+
+
+
+static size_t registered( void *p ){
+    // byte mappati se p è un blocco huge, altrimenti 0
+    std::lock_guard<std::mutex> lk( blocks_lock );
+    for( unsigned i=0; i<blocks.size(); i++ ) if( blocks[i].p == p ) return blocks[i].bytes;
+    return 0;
+}
+
+
+
+static void unregister( void *p ){
+    std::lock_guard<std::mutex> lk( blocks_lock );
+    for( unsigned i=0; i<blocks.size(); i++ ){
+        if( blocks[i].p == p ){
+            blocks[i] = blocks.back();
+            blocks.pop_back();
+            return;
+        }
+    }
+}
+
+
+
+
+void huge_free( void *p ) // HEADER
+{
+    const size_t bytes = p ? registered( p ) : 0;
+    if( !bytes ){
+        free( p );
+        return;
+    }
+    unregister( p );
+    munmap( p, bytes );
+}
+
+
+
+void *huge_realloc( void *p, size_t bytes, const char *what ) // HEADER
+{
+    // come realloc, la parte nuova è indefinita (a zero se mappata)
+    const size_t old = p ? registered( p ) : 0;
+
+    if( !old && ( !huge_pages || bytes < HUGE_MIN )){
+        assert( p = realloc( p, bytes ? bytes : 1 ));
+        return p;
+    }
+
+    const size_t mapped = ROUND_UP( bytes, HUGE_PAGE );
+    if( old == mapped ) return p;
+
+    const char *path = "hugetlb";
+    void *q = map_hugetlb( mapped );
+    if( !q && thp_usable()){
+        path = "thp";
+        q = map_thp( mapped );
+    }
+    if( !q ){
+        // niente pagine grandi, resta tutto com'era
+        fprintf( stderr, "huge: %s %.1f MB -> malloc (niente hugetlb riservate, thp %s)\n"
+            , what, bytes/1048576.0, thp_usable() ? "fallita" : "disattivate" );
+        if( !old ){
+            assert( p = realloc( p, bytes ? bytes : 1 ));
+            return p;
+        }
+        assert( q = malloc( bytes ));
+        memcpy( q, p, old < bytes ? old : bytes );
+        huge_free( p );
+        return q;
+    }
+    fprintf( stderr, "huge: %s %.1f MB -> %s\n", what, bytes/1048576.0, path );
+
+    if( p ){
+        const size_t keep = old ? old : malloc_usable_size( p );
+        memcpy( q, p, keep < bytes ? keep : bytes );
+        huge_free( p );
+    }
+
+    std::lock_guard<std::mutex> lk( blocks_lock );
+    blocks.push_back( (HUGE_BLOCK){ q, mapped });
+    return q;
+}
+
+
+
+void *huge_calloc( size_t bytes, const char *what ) // HEADER
+{
+    // a zero: le mappe lo sono già
+    void *p = huge_realloc( 0, bytes, what );
+    if( !registered( p )) memset( p, 0, bytes );
+    return p;
+}
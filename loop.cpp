@@ -2,10 +2,18 @@
 
 #include "M34.h"
 #include <SDL.h>
-#include <unistd.h>
 #include <frame.h>
 #include <last.h>
 #include <globals.h>
+#include <prof.h>
+#include <stats.h>
+#include <perfctr.h>
+#include <replay.h>
+#include <Camera.h>
+#include <hdr.h>
+#include <render.h>
+#include <checkpoint.h>
+#include <export.h>
 
 
 
@@ -21,9 +29,14 @@ void loop(){    // HEADER
     static char key_down  = 0;
 
     last_load();
+    checkpoint_load();
+    frame_camera( pCamera );
+    render_start();
 
     while(1){
 
+        PROF("loop");
+
         static Uint32 ticks_now = 0;
         static Uint32 ticks_pre = 0;
         ticks_pre = ticks_now;
@@ -41,8 +54,14 @@ void loop(){    // HEADER
         bool camera_touched = false;
 
 
+        uint64_t events_t0 = prof_on ? prof_now() : 0;
+        // il render è su un altro thread: qui si aspetta solo l'input,
+        // o il momento di mostrare un frame
         SDL_Event event;
-        while( SDL_PollEvent( &event )){
+        for( bool have = SDL_WaitEventTimeout( &event, LOOP_WAIT_MS ); have; have = SDL_PollEvent( &event )){
+            // in riproduzione l'input arriva dalla registrazione
+            if( replay_on && event.type != SDL_QUIT ) continue;
+            record_event( &event );
             switch( event.type ){
                 case SDL_MOUSEWHEEL:
 //                    fprintf( stderr, "SDL_MOUSEWHEEL %d %d\n", event.wheel.x, event.wheel.y );
@@ -60,6 +79,7 @@ void loop(){    // HEADER
                         case SDLK_1: speed_mult = SPEED_MULT_1; break;
                         case SDLK_2: speed_mult = SPEED_MULT_2; break;
                         case SDLK_3: speed_mult = SPEED_MULT_3; break;
+                        case SDLK_F12: export_request(); break;
                     }
 //                    // ---- no break intenzionale ----
 
@@ -118,6 +138,7 @@ void loop(){    // HEADER
                     return;
             }
         }
+        if( prof_on ) prof_event( "events", events_t0, prof_now());
 
 
         // rettifica camera
@@ -155,15 +176,73 @@ void loop(){    // HEADER
 
 //        camera_touched = true;  // fissa 1 raggio per pixel
 
-        if( camera_touched ){
-            // se cambia la visuale, resettiamo il buffer hdr
-            samples=0;
-            hdr_zero();
+        if( replay_on ){
+            // finita la registrazione, finita la sessione
+            if( !replay_frame( &camera_touched )) return;
+        }
+        // si registra a cadenza di frame mostrato: la riproduzione fa una
+        // passata e un frame per riga F
+        static bool record_touched = false;
+        record_touched |= camera_touched;
+
+        // le modifiche alla camera vanno al render al più una volta per
+        // frame, ogni applicazione abbandona la passata in corso
+        static bool   camera_pending = false;
+        static Uint32 applied_ticks  = 0;
+        camera_pending |= camera_touched;
+        const bool apply = camera_pending && ( replay_on || ticks_now - applied_ticks >= frame_budget_ms );
+
+        // anteprima progressiva: in movimento un raggio per blocco,
+        // da fermi si riparte da zero a piena risoluzione
+        // con un po' di isteresi, i movimenti del mouse arrivano a singhiozzo
+        int step = CameraFrameStep;
+        if( preview_step > 1 ){
+            static Uint32 touched_ticks = 0;
+            if( camera_touched ) touched_ticks = ticks_now;
+            const bool moving = camera_pending || ticks_now - touched_ticks < PREVIEW_HOLD_MS;
+            step = moving ? preview_step : 1;
         }
-        samples++;
 
-        frame();
-        usleep( 1000 );
-    }
-}    
+        if( apply || step != CameraFrameStep ){
+            render_pause();
+            if( step <= 1 && CameraFrameStep > 1 ){
+                samples=0;
+                hdr_zero();
+            }
+            CameraFrameStep = step;
+
+            if( apply ){
+                if( temporal && CameraFrameStep <= 1 ){
+                    // si tiene quanto accumulato, spostato nella nuova vista
+                    // (non in anteprima, i blocchi sporcherebbero la storia)
+                    Camera view = *pCamera;
+                    frame_camera( &view );
+                    samples = hdr_reproject( &view );
+                    *pCamera = view;
+                }else{
+                    // se cambia la visuale, resettiamo il buffer hdr
+                    samples=0;
+                    hdr_zero();
+                    frame_camera( pCamera );
+                }
+                camera_pending = false;
+                applied_ticks  = ticks_now;
+            }
+            render_resume();
+        }
+
+        // si mostra a cadenza di frame, se il render ha prodotto qualcosa
+        // in riproduzione una passata completa per frame registrato
+        static Uint32 shown_ticks = 0;
+        if( replay_on ) render_wait();
+        if(( replay_on || ticks_now - shown_ticks >= frame_budget_ms ) && render_dirty()){
+            shown_ticks = ticks_now;
+            frame();
+            prof_frame();
+            record_frame( record_touched );
+            record_touched = false;
+        }
 
+        checkpoint_poll();
+    }
+}
@@ -11,6 +11,18 @@
 #include <unistd.h>
 
 #include <globals.h>
+#include <tune.h>
+#include <prof.h>
+#include <stats.h>
+#include <perfctr.h>
+#include <replay.h>
+#include <render.h>
+#include <numa.h>
+#include <huge.h>
+#include <hdr.h>
+#include <checkpoint.h>
+#include <export.h>
+#include <stream.h>
 
 #include "Camera.h"
 #include "Random.h"
@@ -28,8 +40,82 @@ static void makeRenderingObjects( const char *sModelFilePathname ){
 
 
 
+static void usage( const char *argv0 ){
+    fprintf( stderr,
+        "usage: %s [options] scene.obj\n"
+        "  -l LEVELS  build the index lazily, LEVELS levels per visit\n"
+        "  -t         tune the index for the scene, and keep the best settings\n"
+        "  -p FILE    write a chrome/perfetto trace of each stage, and frame times\n"
+        "  -s FILE    write traversal/path counters as json lines (needs -DSTATS)\n"
+        "  -c FILE    write hardware counters per stage and frame, as json lines\n"
+        "  -r FILE    record camera states and input events\n"
+        "  -R FILE    replay a recording, one frame per recorded frame\n"
+        "  -P 4|16    while moving, trace 1/4 or 1/16 of the pixels\n"
+        "  -T         restart accumulation on camera moves, no reprojection\n"
+        "  -H         huge pages for triangles, index and image buffer\n"
+        "  -N         NUMA: replicate the scene per node, pin render threads\n"
+        "  -g WxH     render resolution (default %dx%d)\n"
+        "  -z N       window pixels per render pixel (default %d)\n"
+        "  -k FILE    checkpoint the accumulation to FILE, and resume from it\n"
+        "  -K SECONDS checkpoint interval (default 300, 0 = only on exit and SIGUSR1)\n"
+        "  -o FILE    export the image to FILE.pfm, .exr (half) or .png, on F12 and exit\n"
+        "             (up to 4 times; one %%d or %%04d in FILE numbers the snapshots)\n"
+        "  -O SECONDS also export every SECONDS\n"
+        "  -y FILE    stream the displayed frames to FILE as Y4M 4:2:0 (- = stdout)\n"
+        "  -Y FILE    same, as raw rgb24\n"
+        "  -f MS      frame time: display and camera updates (default 33, 0 = every pass)\n"
+        "             samples per frame follow by themselves: the render accumulates\n"
+        "             on its own thread, no longer in a per-frame budget of passes\n"
+        , argv0, W_DEFAULT, H_DEFAULT, PIXELATE_DEFAULT );
+    exit( 1 );
+}
+
+
+
 int main( int argc, char *argv[]){ 
 
+    bool autotune = false;
+    bool numa = false;
+    const char *trace_path = 0;
+    const char *ckpt_path = 0;
+    float ckpt_interval_s = 300;
+    float export_interval_s = 0;
+    const char *stream_path = 0;
+    bool stream_yuv = true;
+
+    temporal = true;
+    frame_budget_ms = 33;
+
+    int opt;
+    while(( opt = getopt( argc, argv, "l:tp:s:c:r:R:P:Tf:NHg:z:k:K:o:O:y:Y:" )) != -1 ){
+        switch( opt ){
+            case 'l': SpatialIndexLazyLevels = atoi( optarg ); break;
+            case 't': autotune = true; break;
+            case 'p': trace_path = optarg; prof_start(); break;
+            case 's': stats_open( optarg ); break;
+            case 'c': perfctr_start( optarg ); break;
+            case 'r': record_start( optarg ); break;
+            case 'R': replay_start( optarg ); break;
+            case 'P': preview_step = round( sqrt( atoi( optarg ))); break;
+            case 'T': temporal = false; break;
+            case 'f': frame_budget_ms = atof( optarg ); break;
+            case 'N': numa = true; break;
+            case 'H': huge_pages = true; break;
+            case 'g': if( 2 != sscanf( optarg, "%dx%d", &W, &H )) usage( argv[0] ); break;
+            case 'z': PIXELATE = atoi( optarg ); break;
+            case 'k': ckpt_path = optarg; break;
+            case 'K': ckpt_interval_s = atof( optarg ); break;
+            case 'o': if( !export_add( optarg )) usage( argv[0] ); break;
+            case 'O': export_interval_s = atof( optarg ); break;
+            case 'y': stream_path = optarg; stream_yuv = true;  break;
+            case 'Y': stream_path = optarg; stream_yuv = false; break;
+            default : usage( argv[0] );
+        }
+    }
+    if( optind >= argc ) usage( argv[0] );
+    if( preview_step != 0 && preview_step != 2 && preview_step != 4 ) usage( argv[0] );
+    if( W < 3 || H < 3 || PIXELATE < 1 ) usage( argv[0] );
+
     SDL_Window *win;
     assert( win = SDL_CreateWindow( argv[0] 
        , SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED
@@ -49,9 +135,33 @@ int main( int argc, char *argv[]){
     play_icon_w = PLAY_W;
     play_icon_h = PLAY_H;
 
-    makeRenderingObjects( argv[1]);
+    hdr_init();
+    export_start( export_interval_s );
+    if( stream_path ) stream_start( stream_path, stream_yuv );
+
+    if( !autotune ) tune_load( argv[optind]);
+
+    makeRenderingObjects( argv[optind]);
+
+    if( autotune ){
+        SpatialIndexTune( &CameraEyePoint( pCamera ), pScene->aTriangles, pScene->trianglesLength );
+        SceneIndex( pScene, &CameraEyePoint( pCamera ));
+        tune_save( argv[optind]);
+    }
+
+    if( numa ) numa_start( pScene, &CameraEyePoint( pCamera ));
+    if( ckpt_path ) checkpoint_start( ckpt_path, ckpt_interval_s );
 
     loop();
+    checkpoint_save();
+    export_stop();
+    stream_stop();
+    render_stop();
+    record_stop();
+
+    prof_report( trace_path );
+
+    numa_stop();
 
     SceneDestruct((Scene*)pScene );
 
@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <assert.h>
+#include <sched.h>
+#include <thread>
+#include <Scene.h>
+
+
+// modalità NUMA (-N): scena replicata per nodo, thread di render fissati
+//
+// sui biprocessore la scena sta sul nodo di chi l'ha toccata per primo,
+// e metà dei thread attraversa l'indice in memoria remota
+// qui per ogni nodo un thread fissato ai suoi core costruisce una copia
+// di triangoli e indice (prima scrittura = pagine locali), poi i thread
+// di CameraFrame si fissano a un nodo e usano la copia di quel nodo
+//
+// i nodi si leggono da /sys/devices/system/node, senza libnuma
+// con un solo nodo non si fa niente
+
+
+
+#define NUMA_MAX_NODES 64
+
+static int        nodes;
+static cpu_set_t  aNodeCpus[NUMA_MAX_NODES];
+static Scene     *apReplicas[NUMA_MAX_NODES];
+
+static thread_local int thread_node = -1;
+
+
+
+
+static bool cpulist_load( int node, cpu_set_t *pSet ){
+    // formato "0-15,32-47"
+    char path[128];
+    snprintf( path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node );
+    FILE *f = fopen( path, "r" );
+    if( !f ) return false;
+
+    CPU_ZERO( pSet );
+    int a, b;
+    while( fscanf( f, "%d", &a ) == 1 ){
+        b = a;
+        if( fscanf( f, "-%d", &b ) != 1 ) b = a;
+        for( int c=a; c<=b && c<CPU_SETSIZE; c++ ) CPU_SET( c, pSet );
+        if( fgetc( f ) != ',' ) break;
+    }
+    fclose( f );
+    return CPU_COUNT( pSet ) > 0;
+}
+
+
+
+void numa_start( const Scene *pS, const V3f *pEye ) // HEADER
+{
+    // nodi con almeno una cpu, i numeri possono avere buchi
+    for( int n=0; n<NUMA_MAX_NODES; n++ ){
+        if( cpulist_load( n, &aNodeCpus[nodes] )) nodes++;
+    }
+    if( nodes <= 1 ){
+        fprintf( stderr, "numa: %d nodi, niente repliche\n", nodes );
+        nodes = 0;
+        return;
+    }
+
+    // repliche costruite in parallelo, ognuna dal suo nodo
+    std::thread builders[NUMA_MAX_NODES];
+    for( int n=0; n<nodes; n++ ){
+        builders[n] = std::thread( [=](){
+            sched_setaffinity( 0, sizeof(cpu_set_t), &aNodeCpus[n] );
+            apReplicas[n] = SceneReplicate( pS, pEye );
+        });
+    }
+    for( int n=0; n<nodes; n++ ) builders[n].join();
+
+    fprintf( stderr, "numa: %d nodi, scena replicata\n", nodes );
+}
+
+
+
+void numa_pin( int thread, int threads ) // HEADER
+{
+    // thread contigui sullo stesso nodo, come i core
+    if( !nodes ) return;
+    const int node = (long)thread * nodes / threads;
+    if( node == thread_node ) return;
+    sched_setaffinity( 0, sizeof(cpu_set_t), &aNodeCpus[node] );
+    thread_node = node;
+}
+
+
+
+const Scene *numa_scene( const Scene *pS ) // HEADER
+{
+    // la replica del nodo del thread chiamante, o la scena se non fissato
+    return nodes && thread_node >= 0 ? apReplicas[thread_node] : pS;
+}
+
+
+
+void numa_stop() // HEADER
+{
+    for( int n=0; n<nodes; n++ ) SceneDestruct( apReplicas[n] );
+    nodes = 0;
+}
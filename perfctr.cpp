@@ -0,0 +1,206 @@
+
+#include <stdio.h>
+#include <stdint.h>  // HEADER
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <mutex>
+#include <vector>
+
+
+// contatori hardware per stadio di render, via perf_event_open
+//
+//     {
+//         PERFCTR( PERFCTR_TRACE );
+//         ...
+//     }
+//
+// ogni thread apre il suo gruppo (cycles, instructions, cache-misses,
+// branch-misses) al primo scope, e somma i delta nel suo accumulatore
+// perfctr_frame() tra un frame e l'altro somma i thread, azzera,
+// e scrive una riga json nel file di -c
+//
+// ogni scope costa due read(), quindi va messo attorno a righe o
+// blocchi, non ai singoli raggi: traversal e shading finiscono
+// insieme nello stadio "trace"
+//
+// i thread fuori dal frame (es. la scrittura degli export) mettono
+// perfctr_muted: gli stadi sono quelli del frame, e perfctr_frame()
+// azzera gli accumulatori solo a render fermo, non a export fermo.
+// il flag è per thread, quindi chi apre una regione omp lo legge prima
+// e lo passa ai thread del team con PERFCTR_IF
+
+
+
+// HEADERBEG
+enum {
+    PERFCTR_RAYGEN,
+    PERFCTR_TRACE,
+    PERFCTR_FIREFLY,
+    PERFCTR_TONEMAP,
+    PERFCTR_STAGES
+};
+
+#define PERFCTR_EVENTS  4
+
+extern bool perfctr_on;
+extern thread_local bool perfctr_muted;
+void perfctr_read( uint64_t v[PERFCTR_EVENTS] );
+void perfctr_add( int stage, const uint64_t v0[PERFCTR_EVENTS] );
+
+struct PERFCTR_SCOPE {
+    int stage;
+    bool on;
+    uint64_t v0[PERFCTR_EVENTS];
+    PERFCTR_SCOPE( int stage_, bool on_ ) : stage( stage_ ), on( on_ && perfctr_on ){ if( on ) perfctr_read( v0 ); }
+    ~PERFCTR_SCOPE(){ if( on ) perfctr_add( stage, v0 ); }
+};
+#define PERFCTR_CAT_(A,B) A ##B
+#define PERFCTR_CAT(A,B) PERFCTR_CAT_(A,B)
+#define PERFCTR(STAGE) PERFCTR_SCOPE PERFCTR_CAT(perfctr_scope_,__LINE__)( STAGE, !perfctr_muted )
+#define PERFCTR_IF(STAGE,ON) PERFCTR_SCOPE PERFCTR_CAT(perfctr_scope_,__LINE__)( STAGE, ON )
+// HEADEREND
+
+
+
+static const char *STAGE_NAME[PERFCTR_STAGES] = { "raygen", "trace", "firefly", "tonemap" };
+static const char *EVENT_NAME[PERFCTR_EVENTS] = { "cycles", "instructions", "cache_misses", "branch_misses" };
+static const uint64_t EVENT_CONFIG[PERFCTR_EVENTS] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+
+struct PERFCTR_GROUP {
+    int      leader;
+    int      slot[PERFCTR_EVENTS];   // posizione nella lettura di gruppo, -1 se l'evento manca
+    int      opened;
+    uint64_t acc[PERFCTR_STAGES][PERFCTR_EVENTS];
+};
+
+static FILE                       *perfctr_file;
+static std::mutex                  groups_lock;
+static std::vector<PERFCTR_GROUP*> groups;
+static thread_local PERFCTR_GROUP *group;
+static int                         frame_no;
+
+
+bool perfctr_on;    // HEADER
+thread_local bool perfctr_muted;
+
+
+
+
+static int open_event( uint64_t config, int group_fd ){
+    struct perf_event_attr attr;
+    memset( &attr, 0, sizeof(attr));
+    attr.size           = sizeof(attr);
+    attr.type           = PERF_TYPE_HARDWARE;
+    attr.config         = config;
+    attr.read_format    = PERF_FORMAT_GROUP;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+    // solo questo thread, su qualunque cpu
+    return syscall( __NR_perf_event_open, &attr, 0, -1, group_fd, 0 );
+}
+
+
+
+static PERFCTR_GROUP *group_open(){
+
+    group = new PERFCTR_GROUP();
+    group->leader = -1;
+
+    for( int e=0; e<PERFCTR_EVENTS; e++ ){
+        int fd = open_event( EVENT_CONFIG[e], group->leader );
+        group->slot[e] = -1;
+        if( fd < 0 ) continue;
+        if( group->leader < 0 ) group->leader = fd;
+        group->slot[e] = group->opened++;
+    }
+
+    std::lock_guard<std::mutex> lock( groups_lock );
+    groups.push_back( group );
+    return group;
+}
+
+
+
+void perfctr_read( uint64_t v[PERFCTR_EVENTS] ) // HEADER
+{
+    PERFCTR_GROUP *g = group ? group : group_open();
+
+    // PERF_FORMAT_GROUP: nr, poi i valori nell'ordine di apertura
+    uint64_t buf[1+PERFCTR_EVENTS] = {0};
+    if( g->leader >= 0 ) read( g->leader, buf, sizeof(buf));
+
+    for( int e=0; e<PERFCTR_EVENTS; e++ ){
+        v[e] = g->slot[e] < 0 ? 0 : buf[1+g->slot[e]];
+    }
+}
+
+
+
+void perfctr_add( int stage, const uint64_t v0[PERFCTR_EVENTS] ) // HEADER
+{
+    uint64_t v1[PERFCTR_EVENTS];
+    perfctr_read( v1 );
+    for( int e=0; e<PERFCTR_EVENTS; e++ ) group->acc[stage][e] += v1[e] - v0[e];
+}
+
+
+
+void perfctr_start( const char *path ) // HEADER
+{
+    // prova sul thread principale, se il kernel non concede niente lasciamo perdere
+    int fd = open_event( PERF_COUNT_HW_CPU_CYCLES, -1 );
+    if( fd < 0 ){
+        perror( "perf_event_open" );
+        fprintf( stderr, "perfctr: contatori non disponibili, vedi /proc/sys/kernel/perf_event_paranoid\n" );
+        return;
+    }
+    close( fd );
+
+    perfctr_file = fopen( path, "wb" );
+    if( !perfctr_file ){
+        perror( path );
+        return;
+    }
+    perfctr_on = true;
+}
+
+
+
+void perfctr_frame() // HEADER
+{
+    // da chiamare tra un frame e l'altro, con i thread di render fermi
+    if( !perfctr_on ) return;
+
+    uint64_t t[PERFCTR_STAGES][PERFCTR_EVENTS] = {{0}};
+    bool missing[PERFCTR_EVENTS] = {false};
+    {
+        std::lock_guard<std::mutex> lock( groups_lock );
+        for( PERFCTR_GROUP *g : groups ){
+            for( int s=0; s<PERFCTR_STAGES; s++ )
+            for( int e=0; e<PERFCTR_EVENTS; e++ ) t[s][e] += g->acc[s][e];
+            for( int e=0; e<PERFCTR_EVENTS; e++ ) missing[e] |= g->slot[e] < 0;
+            memset( g->acc, 0, sizeof(g->acc));
+        }
+    }
+
+    fprintf( perfctr_file, "{\"frame\":%d", frame_no++ );
+    for( int s=0; s<PERFCTR_STAGES; s++ ){
+        fprintf( perfctr_file, ",\"%s\":{", STAGE_NAME[s] );
+        for( int e=0; e<PERFCTR_EVENTS; e++ ){
+            // gli eventi che il kernel non ha aperto escono null
+            if( missing[e] ) fprintf( perfctr_file, "\"%s\":null,", EVENT_NAME[e] );
+            else             fprintf( perfctr_file, "\"%s\":%lu,", EVENT_NAME[e], t[s][e] );
+        }
+        fprintf( perfctr_file, "\"ipc\":%.3f}", t[s][0] ? (double)t[s][1]/t[s][0] : 0.0 );
+    }
+    fprintf( perfctr_file, "}\n" );
+}
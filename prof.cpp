@@ -0,0 +1,148 @@
+
+#include <stdio.h>
+#include <stdint.h>  // HEADER
+#include <stdlib.h>
+#include <time.h>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+
+
+// profiling leggero a scope
+//
+//     {
+//         PROF("nome");   // letterale, non viene copiato
+//         ...
+//     }
+//
+// ogni thread accoda gli eventi nel suo buffer, senza lock
+// a fine sessione prof_report() scrive il trace json per
+// chrome://tracing o ui.perfetto.dev, e il riassunto dei tempi frame
+// se prof_on è falso lo scope costa un test
+
+
+
+
+struct PROF_EVENT {
+    const char *name;
+    uint64_t    t0;
+    uint64_t    t1;
+};
+
+struct PROF_BUFFER {
+    int tid;
+    std::vector<PROF_EVENT> events;
+};
+
+static std::mutex                buffers_lock;
+static std::vector<PROF_BUFFER*> buffers;
+static thread_local PROF_BUFFER *buffer;
+
+static std::vector<float> frame_ms;
+static uint64_t           frame_t0;
+static uint64_t           start_t0;
+
+
+bool prof_on;   // HEADER
+
+
+
+
+uint64_t prof_now() // HEADER
+{
+    // ns
+    struct timespec t;
+    clock_gettime( CLOCK_MONOTONIC, &t );
+    return t.tv_sec*1000000000ull + t.tv_nsec;
+}
+
+
+
+void prof_event( const char *name, uint64_t t0, uint64_t t1 ) // HEADER
+{
+    if( !buffer ){
+        // primo evento del thread, registriamo il buffer
+        buffer = new PROF_BUFFER;
+        buffer->events.reserve( 4096 );
+        std::lock_guard<std::mutex> lock( buffers_lock );
+        buffer->tid = buffers.size();
+        buffers.push_back( buffer );
+    }
+    buffer->events.push_back({ name, t0, t1 });
+}
+
+
+
+// HEADERBEG
+struct PROF_SCOPE {
+    const char *name;
+    uint64_t    t0;
+    PROF_SCOPE( const char *name_ ) : name( name_ ), t0( prof_on ? prof_now() : 0 ){}
+    ~PROF_SCOPE(){ if( prof_on ) prof_event( name, t0, prof_now()); }
+};
+#define PROF_CAT_(A,B) A##B
+#define PROF_CAT(A,B)  PROF_CAT_(A,B)
+#define PROF(NAME)     PROF_SCOPE PROF_CAT(prof_scope_,__LINE__)( NAME )
+// HEADEREND
+
+
+
+void prof_start() // HEADER
+{
+    prof_on  = true;
+    start_t0 = prof_now();
+}
+
+
+
+void prof_frame() // HEADER
+{
+    // da chiamare una volta per frame, dal thread del loop
+    if( !prof_on ) return;
+    uint64_t t = prof_now();
+    if( frame_t0 ) frame_ms.push_back(( t - frame_t0 )*1e-6 );
+    frame_t0 = t;
+}
+
+
+
+static float percentile( std::vector<float> &v, float p ){
+    // v ordinato
+    size_t i = p*( v.size()-1 )+0.5;
+    return v[i];
+}
+
+
+
+void prof_report( const char *trace_path ) // HEADER
+{
+    if( !prof_on ) return;
+
+    FILE *f = fopen( trace_path, "wb" );
+    if( f ){
+        // formato "trace event": eventi completi "X", tempi in µs
+        fprintf( f, "{\"traceEvents\":[\n" );
+        const char *sep = "";
+        std::lock_guard<std::mutex> lock( buffers_lock );
+        for( auto b : buffers ){
+            fprintf( f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                "\"args\":{\"name\":\"%s %d\"}}", sep, b->tid, b->tid ? "thread" : "main", b->tid );
+            sep = ",\n";
+            for( auto &e : b->events ){
+                fprintf( f, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}"
+                    , sep, e.name, b->tid, ( e.t0 - start_t0 )*1e-3, ( e.t1 - e.t0 )*1e-3 );
+            }
+        }
+        fprintf( f, "\n]}\n" );
+        fclose( f );
+        fprintf( stderr, "prof: trace in %s\n", trace_path );
+    }
+
+    if( frame_ms.empty()) return;
+    std::vector<float> v = frame_ms;
+    std::sort( v.begin(), v.end());
+    double sum = 0;
+    for( float ms : v ) sum += ms;
+    fprintf( stderr, "prof: %zu frames, ms mean %.2f p50 %.2f p99 %.2f max %.2f\n"
+        , v.size(), sum/v.size(), percentile( v, 0.5 ), percentile( v, 0.99 ), v.back());
+}
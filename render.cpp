@@ -0,0 +1,106 @@
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <SDL.h>
+#include <globals.h>
+#include <Camera.h>
+
+
+// render asincrono: un thread di lavoro accumula passate di CameraFrame
+// nel buffer hdr, mentre il thread di SDL resta libero per l'input
+//
+// chi tocca buffer hdr, pCamera, CameraFrameStep o samples sospende il lavoro:
+//
+//     render_pause();
+//     ...
+//     render_resume();
+//
+// la pausa abbandona la passata in corso: CameraFrame controlla l'epoca
+// tra un tassello e l'altro, quindi si aspetta al più un tassello per
+// thread, non un frame
+// i tasselli già fatti restano nell'accumulo (i conteggi sono per pixel) e
+// la passata dopo parte da quelli rimasti indietro, poi dai più costosi
+// (LPT, con furto tra le code dei thread), quindi anche passate sempre
+// interrotte coprono tutta l'immagine
+
+
+
+static std::mutex              lock;       // tenuto dal thread di lavoro durante la passata
+static std::condition_variable resumed;
+static std::atomic<bool>       pause_request;
+static std::atomic<bool>       dirty;      // qualcosa di nuovo da mostrare
+static std::atomic<unsigned>   passes;
+static std::atomic<unsigned>   epoch;
+static bool                    quit;
+static std::thread             worker;
+
+
+
+
+static void work(){
+    std::unique_lock<std::mutex> lk( lock );
+    while( !quit ){
+        if( pause_request ){
+            resumed.wait( lk );
+            continue;
+        }
+        if( CameraFrame( pCamera, pScene, pRandom )) passes++;
+        dirty = true;
+    }
+}
+
+
+
+void render_start() // HEADER
+{
+    CameraFrameEpoch = &epoch;
+    worker = std::thread( work );
+}
+
+
+
+void render_pause() // HEADER
+{
+    pause_request = true;
+    epoch++;
+    lock.lock();
+}
+
+
+
+void render_resume() // HEADER
+{
+    pause_request = false;
+    lock.unlock();
+    resumed.notify_one();
+}
+
+
+
+bool render_dirty() // HEADER
+{
+    // vero se dall'ultima chiamata è finita una passata, anche interrotta
+    return dirty.exchange( false );
+}
+
+
+
+void render_wait() // HEADER
+{
+    // fino alla prossima passata completa
+    const unsigned n = passes;
+    while( passes == n ) SDL_Delay( 1 );
+}
+
+
+
+void render_stop() // HEADER
+{
+    render_pause();
+    quit = true;
+    render_resume();
+    worker.join();
+    CameraFrameEpoch = 0;
+}
@@ -0,0 +1,115 @@
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <SDL.h>    // HEADER
+#include <globals.h>
+
+
+// registrazione e riproduzione delle sessioni interattive
+//
+//     ./main -r sessione.txt scena.obj     registra
+//     ./main -R sessione.txt scena.obj     riproduce
+//
+// in registrazione ogni frame mostrato da loop() scrive lo stato della
+// camera, più gli eventi arrivati nel frattempo (toccata: mossa dal frame
+// prima):
+//
+//     F frame ms toccata expo speed_mult m00,m01,...,m23
+//     E frame ms tipo a b
+//
+// in riproduzione loop() ignora l'input (tranne SDL_QUIT) e prende
+// camera, expo e speed_mult dalle righe F, una per frame mostrato, senza
+// guardare l'orologio: il percorso della camera non dipende più dal
+// frame rate, quindi tempi frame e convergenza sono confrontabili
+// tra build diverse. le righe E sono solo documentazione
+
+
+
+bool replay_on;     // HEADER
+
+static FILE  *record_file;
+static FILE  *replay_file;
+static int    frame_no;
+static Uint32 ticks_t0;
+
+
+
+
+void record_start( const char *path ) // HEADER
+{
+    assert( record_file = fopen( path, "wb" ));
+    fprintf( record_file, "# F frame ms touched expo speed_mult camera[12]\n" );
+    fprintf( record_file, "# E frame ms type a b\n" );
+    ticks_t0 = SDL_GetTicks();
+}
+
+
+
+void replay_start( const char *path ) // HEADER
+{
+    assert( replay_file = fopen( path, "rb" ));
+    replay_on = true;
+}
+
+
+
+void record_event( const SDL_Event *e ) // HEADER
+{
+    if( !record_file ) return;
+
+    int a = 0, b = 0;
+    switch( e->type ){
+        case SDL_KEYDOWN:
+        case SDL_KEYUP:           a = e->key.keysym.sym;  b = e->key.state;  break;
+        case SDL_MOUSEMOTION:     a = e->motion.xrel;     b = e->motion.yrel; break;
+        case SDL_MOUSEWHEEL:      a = e->wheel.x;         b = e->wheel.y;     break;
+        case SDL_MOUSEBUTTONDOWN:
+        case SDL_MOUSEBUTTONUP:   a = e->button.button;   break;
+        case SDL_QUIT:            break;
+        default: return;
+    }
+    fprintf( record_file, "E %d %u %d %d %d\n", frame_no, SDL_GetTicks()-ticks_t0, e->type, a, b );
+}
+
+
+
+void record_frame( bool touched ) // HEADER
+{
+    if( !record_file ) return;
+
+    fprintf( record_file, "F %d %u %d %.9g %d", frame_no++, SDL_GetTicks()-ticks_t0, touched, expo, speed_mult );
+    for( int i=0; i<12; i++ ) fprintf( record_file, "%c%.9g", i ? ',' : ' ', camera.raw[i] );
+    fprintf( record_file, "\n" );
+}
+
+
+
+bool replay_frame( bool *pTouched ) // HEADER
+{
+    // falso a fine registrazione
+    char line[512];
+    while( fgets( line, sizeof(line), replay_file )){
+        if( line[0] != 'F' ) continue;
+
+        int frame, touched;
+        unsigned ms;
+        float *m = camera.raw;
+        assert( 17 == sscanf( line, "F %d %u %d %f %d %f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f"
+            , &frame, &ms, &touched, &expo, &speed_mult
+            , m+0, m+1, m+2, m+3, m+4, m+5, m+6, m+7, m+8, m+9, m+10, m+11 ));
+        *pTouched = touched;
+        return true;
+    }
+    fclose( replay_file );
+    replay_file = 0;
+    return false;
+}
+
+
+
+void record_stop() // HEADER
+{
+    if( record_file ) fclose( record_file );
+    record_file = 0;
+}
@@ -0,0 +1,152 @@
+
+#include <stdio.h>
+#include <stdint.h>  // HEADER
+#include <inttypes.h>
+#include <mutex>
+#include <vector>
+#include <SpatialIndex.h>
+
+
+// contatori di traversal e path, per tarare indice e integratore
+// esistono solo compilando con -DSTATS (vedi Makefile), altrimenti
+// le macro STAT_* sono un ramo mai preso e il costo è zero
+//
+// ogni thread conta nei suoi contatori, stats_frame() a fine frame
+// li somma, li azzera, e scrive una riga json nel file di -s
+// stats_index() scrive una riga con occupazione delle foglie
+// e fattore di duplicazione dell'indice appena costruito
+
+
+
+// HEADERBEG
+#define STATS_PATH_MAX  16
+#define STATS_LEAF_MAX  33
+
+struct SpatialIndex;
+
+struct STATS_COUNTERS {
+    uint64_t rays;
+    uint64_t nodes;
+    uint64_t triangles;
+    uint64_t paths;
+    uint64_t path_length[STATS_PATH_MAX];  // segmenti, l'ultimo è "o più"
+    uint64_t rr_tests;
+    uint64_t rr_kills;
+    uint64_t shadow_rays;
+    uint64_t shadow_occluded;
+    int      depth;
+};
+
+// le macro si definiscono una volta sola, mk-headers vede entrambi i
+// rami degli #ifdef: senza STATS il ramo è costante falso e sparisce
+#ifdef STATS
+static const bool STATS_ON = true;
+#else
+static const bool STATS_ON = false;
+#endif
+extern thread_local STATS_COUNTERS *stats_tls;
+STATS_COUNTERS *stats_register();
+static inline STATS_COUNTERS *stats_local(){ return stats_tls ? stats_tls : stats_register(); }
+#define STAT_ADD(FIELD,N)        ( STATS_ON ? (void)( stats_local()->FIELD += (N)) : (void)0 )
+#define STAT_PATH_NEXT(PRIMARY)  ( STATS_ON ? (void)( stats_local()->depth = (PRIMARY) ? ( ++stats_local()->paths, 1 ) : stats_local()->depth+1 ) : (void)0 )
+#define STAT_PATH_END()          ( STATS_ON ? (void)( ++stats_local()->path_length[ stats_local()->depth < STATS_PATH_MAX ? stats_local()->depth : STATS_PATH_MAX-1 ]) : (void)0 )
+// HEADEREND
+
+
+
+static FILE                *stats_file;
+static std::mutex           threads_lock;
+static std::mutex           file_lock;      // righe intere: gli indici dei nodi numa si fanno in parallelo
+static std::vector<STATS_COUNTERS*>  threads;
+static int                  frame_no;
+
+thread_local STATS_COUNTERS *stats_tls;
+
+
+
+STATS_COUNTERS *stats_register(){
+    stats_tls = new STATS_COUNTERS();
+    std::lock_guard<std::mutex> lock( threads_lock );
+    threads.push_back( stats_tls );
+    return stats_tls;
+}
+
+
+
+void stats_open( const char *path ) // HEADER
+{
+#ifndef STATS
+    fprintf( stderr, "stats: %s ignorato, compilare con -DSTATS\n", path );
+#else
+    stats_file = fopen( path, "wb" );
+    if( !stats_file ) perror( path );
+#endif
+}
+
+
+
+static double ratio( uint64_t a, uint64_t b ){
+    return b ? (double)a/b : 0;
+}
+
+
+
+void stats_index( const SpatialIndex *pIndex, int triangles ) // HEADER
+{
+    if( !stats_file ) return;
+
+    int leaves[STATS_LEAF_MAX] = {0};
+    const int refs = SpatialIndexLeaves( pIndex, leaves, STATS_LEAF_MAX );
+
+    int n = 0;
+    for( int i=0; i<STATS_LEAF_MAX; i++ ) n += leaves[i];
+
+    std::lock_guard<std::mutex> lock( file_lock );
+    fprintf( stats_file, "{\"index\":{\"triangles\":%d,\"nodes\":%d,\"leaves\":%d,\"refs\":%d"
+        ",\"duplication\":%.4f,\"items_per_leaf\":%.4f,\"bytes\":%zu,\"leaf_items\":["
+        , triangles, pIndex->nodesLength, n, refs
+        , ratio( refs, triangles ), ratio( refs, n ), SpatialIndexBytes( pIndex ));
+    for( int i=0; i<STATS_LEAF_MAX; i++ ) fprintf( stats_file, "%s%d", i ? "," : "", leaves[i] );
+    fprintf( stats_file, "]}}\n" );
+    fflush( stats_file );
+}
+
+
+
+void stats_frame() // HEADER
+{
+    // da chiamare tra un frame e l'altro, con i thread di render fermi
+    if( !stats_file ) return;
+
+    STATS_COUNTERS t = STATS_COUNTERS();
+    {
+        std::lock_guard<std::mutex> lock( threads_lock );
+        for( STATS_COUNTERS *s : threads ){
+            t.rays            += s->rays;
+            t.nodes           += s->nodes;
+            t.triangles       += s->triangles;
+            t.paths           += s->paths;
+            t.rr_tests        += s->rr_tests;
+            t.rr_kills        += s->rr_kills;
+            t.shadow_rays     += s->shadow_rays;
+            t.shadow_occluded += s->shadow_occluded;
+            for( int i=0; i<STATS_PATH_MAX; i++ ) t.path_length[i] += s->path_length[i];
+            int depth = s->depth;
+            *s = STATS_COUNTERS();
+            s->depth = depth;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock( file_lock );
+    fprintf( stats_file, "{\"frame\":%d,\"rays\":%" PRIu64 ",\"nodes\":%" PRIu64 ",\"triangles\":%" PRIu64
+        ",\"nodes_per_ray\":%.4f,\"triangles_per_ray\":%.4f"
+        ",\"paths\":%" PRIu64 ",\"rr_tests\":%" PRIu64 ",\"rr_kills\":%" PRIu64 ",\"rr_kill_rate\":%.4f"
+        ",\"shadow_rays\":%" PRIu64 ",\"shadow_occluded\":%" PRIu64 ",\"shadow_occlusion_rate\":%.4f"
+        ",\"path_length\":["
+        , frame_no++, t.rays, t.nodes, t.triangles
+        , ratio( t.nodes, t.rays ), ratio( t.triangles, t.rays )
+        , t.paths, t.rr_tests, t.rr_kills, ratio( t.rr_kills, t.rr_tests )
+        , t.shadow_rays, t.shadow_occluded, ratio( t.shadow_occluded, t.shadow_rays ));
+    for( int i=0; i<STATS_PATH_MAX; i++ ) fprintf( stats_file, "%s%" PRIu64, i ? "," : "", t.path_length[i] );
+    fprintf( stats_file, "]}\n" );
+}
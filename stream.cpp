@@ -0,0 +1,230 @@
+
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <globals.h>
+#include <hdr.h>
+#include <prof.h>
+
+
+// frame mostrati in streaming, da dare in pasto a un encoder
+//
+//     ./main -y - -R giro.txt scena.obj | ffmpeg -i - giro.mp4
+//     ./main -Y /tmp/fifo scena.obj       rgb24 grezzo, -s WxH lato ffmpeg
+//
+// -y scrive YUV4MPEG2 4:2:0 (C420jpeg), -Y rgb24 senza intestazione;
+// "-" è stdout. si manda l'immagine di hdr_to_sdl(), tone mapping e
+// filtro compresi, alla frequenza di -f (F1000:ms nell'intestazione)
+//
+// doppio buffer: frame() copia l'RGB in uno slot libero e torna, un
+// thread converte e scrive l'altro, quindi l'encoder lavora in parallelo
+// al render. se l'encoder è più lento dei frame frame() aspetta uno
+// slot: in un video i frame non si saltano (il render non si ferma, gira
+// sul suo thread)
+//
+// conversione BT.601 range limitato, interi a 8 bit di frazione come da
+// manuale, righe in loop senza dipendenze, vettorizzate; il croma 4:2:0
+// è la media di blocchi 2x2, centrata come vuole C420jpeg
+
+
+
+struct STREAM_SLOT {
+    uint8_t *rgb;
+    bool     full;
+};
+
+static FILE                   *out;
+static bool                    y4m;
+static int                     stream_w, stream_h;
+static STREAM_SLOT             slots[2];
+static int                     fill;       // prossimo slot di frame()
+static uint8_t                *YUV;        // un frame convertito
+static std::mutex              lock;
+static std::condition_variable changed;
+static std::thread             writer;
+static bool                    quit;
+static bool                    broken;     // encoder chiuso, si smette
+
+
+
+
+// conversione -----------------------------------------------------------------
+
+// le righe RGB sono a passo 3: servono i pshufb di SSSE3 per
+// vettorizzarle, quindi una versione per livello, scelta al caricamento
+#define STREAM_SIMD __attribute__(( target_clones( "avx2", "ssse3", "default" )))
+
+static int16_t *aU[2], *aV[2];     // croma non scalato di due righe
+
+
+
+STREAM_SIMD
+static void luma_row( uint8_t *pY, const uint8_t *pRGB, int w ){
+#pragma omp simd
+    for( int x=0; x<w; x++ ){
+        const int r = pRGB[x*3+0], g = pRGB[x*3+1], b = pRGB[x*3+2];
+        pY[x] = (( 66*r + 129*g + 25*b + 128 ) >> 8 ) + 16;
+    }
+}
+
+
+
+STREAM_SIMD
+static void chroma_row( int16_t *pU, int16_t *pV, const uint8_t *pRGB, int w ){
+    // per pixel, prima dello shift: sta in 16 bit (112*255)
+#pragma omp simd
+    for( int x=0; x<w; x++ ){
+        const int r = pRGB[x*3+0], g = pRGB[x*3+1], b = pRGB[x*3+2];
+        pU[x] = -38*r -  74*g + 112*b;
+        pV[x] = 112*r -  94*g -  18*b;
+    }
+}
+
+
+
+STREAM_SIMD
+static void chroma_420( uint8_t *pOut, const int16_t *p0, const int16_t *p1, int w ){
+    // media 2x2 di una coppia di righe, il bordo dispari ripete l'ultimo
+    // somme di 4: si divide insieme all'8 bit di frazione
+    const int cw = w / 2;
+#pragma omp simd
+    for( int x=0; x<cw; x++ ){
+        pOut[x] = (( p0[2*x] + p0[2*x+1] + p1[2*x] + p1[2*x+1] + 512 ) >> 10 ) + 128;
+    }
+    if( w & 1 ) pOut[cw] = (( 2*( p0[w-1] + p1[w-1] ) + 512 ) >> 10 ) + 128;
+}
+
+
+
+static size_t to_yuv420( uint8_t *pOut, const uint8_t *pRGB, int w, int h ){
+    const int cw = ( w+1 ) / 2, ch = ( h+1 ) / 2;
+    uint8_t *pY = pOut, *pU = pY + w*h, *pV = pU + cw*ch;
+    for( int y=0; y<h; y++ ) luma_row( pY + y*w, pRGB + y*w*3, w );
+    for( int y=0; y<ch; y++ ){
+        const uint8_t *row0 = pRGB + 2*y*w*3;
+        const uint8_t *row1 = 2*y+1 < h ? row0 + w*3 : row0;
+        chroma_row( aU[0], aV[0], row0, w );
+        chroma_row( aU[1], aV[1], row1, w );
+        chroma_420( pU + y*cw, aU[0], aU[1], w );
+        chroma_420( pV + y*cw, aV[0], aV[1], w );
+    }
+    return w*h + 2*cw*ch;
+}
+
+
+
+
+// thread di scrittura ---------------------------------------------------------
+
+static bool put( const void *p, size_t n ){
+    return 1 == fwrite( p, n, 1, out );
+}
+
+
+
+static void work(){
+    std::unique_lock<std::mutex> lk( lock );
+    for( int s=0; ; s^=1 ){
+        // gli slot si scrivono nell'ordine in cui frame() li riempie
+        while( !slots[s].full && !quit ) changed.wait( lk );
+        if( !slots[s].full ) return;
+        lk.unlock();
+
+        bool ok;
+        {
+            PROF("stream");
+            if( y4m ){
+                const size_t n = to_yuv420( YUV, slots[s].rgb, stream_w, stream_h );
+                ok = put( "FRAME\n", 6 ) && put( YUV, n );
+            }else{
+                ok = put( slots[s].rgb, (size_t)stream_w*stream_h*3 );
+            }
+            ok = ok && !fflush( out );
+        }
+
+        lk.lock();
+        if( !ok && !broken ){
+            broken = true;
+            fprintf( stderr, "stream: scrittura fallita (%s), lo streaming si ferma\n", strerror( errno ));
+        }
+        slots[s].full = false;
+        changed.notify_all();
+    }
+}
+
+
+
+
+// API -------------------------------------------------------------------------
+
+void stream_start( const char *path, bool yuv ) // HEADER
+{
+    // dopo hdr_init(), a risoluzione scelta
+    if( !strcmp( path, "-" )) out = stdout;
+    else assert( out = fopen( path, "wb" ));
+    y4m      = yuv;
+    stream_w = W;
+    stream_h = H;
+
+    // un encoder che chiude la pipe non deve ammazzare il renderer
+    signal( SIGPIPE, SIG_IGN );
+
+    for( int s=0; s<2; s++ ) assert( slots[s].rgb = (uint8_t*)malloc( (size_t)W*H*3 ));
+    assert( YUV = (uint8_t*)malloc( (size_t)W*H*3 ));
+    for( int i=0; i<2; i++ ){
+        assert( aU[i] = (int16_t*)malloc( W*sizeof(int16_t)));
+        assert( aV[i] = (int16_t*)malloc( W*sizeof(int16_t)));
+    }
+
+    if( y4m ){
+        const int ms = frame_budget_ms > 0 ? frame_budget_ms : 0;
+        fprintf( out, "YUV4MPEG2 W%d H%d F%d:%d Ip A1:1 C420jpeg XYSCSS=420JPEG\n"
+            , W, H, ms ? 1000 : 30, ms ? ms : 1 );
+    }
+    writer = std::thread( work );
+}
+
+
+
+void stream_frame() // HEADER
+{
+    // da frame(), dopo hdr_to_sdl()
+    if( !out ) return;
+    std::unique_lock<std::mutex> lk( lock );
+    if( broken ) return;
+    {
+        PROF("stream_wait");
+        while( slots[fill].full ) changed.wait( lk );
+    }
+    lk.unlock();
+    memcpy( slots[fill].rgb, hdr_rgb8(), (size_t)stream_w*stream_h*3 );
+    lk.lock();
+    slots[fill].full = true;
+    fill ^= 1;
+    changed.notify_all();
+}
+
+
+
+void stream_stop() // HEADER
+{
+    // i frame in coda si scrivono tutti
+    if( !out ) return;
+    {
+        std::lock_guard<std::mutex> lk( lock );
+        quit = true;
+        changed.notify_all();
+    }
+    writer.join();
+    if( out != stdout ) fclose( out );
+    else fflush( out );
+    out = 0;
+}
@@ -0,0 +1,227 @@
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <prof.h>
+#include <globals.h>
+#include <last.h>
+#include <Camera.h>
+#include <Scene.h>
+#include <Random.h>
+
+
+// render a tasselli, senza finestra, per immagini più grandi della memoria
+//
+//     ./tiled -g 40000x22500 -s 256 -o poster.tif scene.obj
+//
+// l'immagine non esiste mai tutta: ogni tassello è reso fino in fondo da
+// CameraRegion() e scritto subito nel file, quindi in memoria ci sono la
+// scena, un tassello e la tabella degli offset (16 byte a tassello)
+//
+// il file è un BigTIFF a tasselli, RGB float 32 bit lineare (radianza
+// media, niente tone mapping), non compresso: ogni tassello ha la stessa
+// dimensione, quelli sul bordo sono completati a zero come vuole il TIFF
+//
+//     header    16 byte, offset della IFD riscritto alla fine
+//     tasselli  per righe, come escono dal render
+//     IFD       in coda, con TileOffsets e TileByteCounts
+
+
+
+#define TIFF_SHORT  3
+#define TIFF_LONG   4
+#define TIFF_LONG8  16
+
+
+static int  tile        = 256;
+static int  spp         = 64;
+static bool last_view   = false;
+
+
+
+
+static double seconds( uint64_t t0 ){
+    return ( prof_now() - t0 ) * 1e-9;
+}
+
+
+
+static void camera_setup(){
+    if( !last_view ) return;
+    // come frame_camera(), dalla vista salvata dalla sessione interattiva
+    last_load();
+    pCamera->viewPosition  = V3f( camera.t.x, camera.t.y, camera.t.z );
+    pCamera->viewDirection = V3f( camera.z.x, camera.z.y, camera.z.z );
+    pCamera->right         = V3f( camera.x.x, camera.x.y, camera.x.z );
+    pCamera->up            = V3f( camera.y.x, camera.y.y, camera.y.z );
+}
+
+
+
+
+// BigTIFF ---------------------------------------------------------------------
+
+// host little endian, come "II"
+
+static void put( FILE *f, const void *p, size_t n ){
+    assert( 1 == fwrite( p, n, 1, f ));
+}
+
+static void put16( FILE *f, uint16_t v ){ put( f, &v, 2 ); }
+static void put64( FILE *f, uint64_t v ){ put( f, &v, 8 ); }
+
+
+
+static void tiff_header( FILE *f, uint64_t ifd ){
+    put( f, "II", 2 );
+    put16( f, 43 );     // BigTIFF
+    put16( f, 8 );      // byte per offset
+    put16( f, 0 );
+    put64( f, ifd );
+}
+
+
+
+static void tiff_entry( FILE *f, uint16_t tag, uint16_t type, uint64_t count, uint64_t value ){
+    // value è il valore stesso se ci sta in 8 byte, altrimenti l'offset
+    put16( f, tag );
+    put16( f, type );
+    put64( f, count );
+    put64( f, value );
+}
+
+
+
+static uint64_t shorts( uint16_t a, uint16_t b, uint16_t c ){
+    // tre SHORT nel campo valore, allineati a sinistra
+    return a | (uint64_t)b << 16 | (uint64_t)c << 32;
+}
+
+
+
+static void tiff_ifd( FILE *f, int w, int h, int tiles, uint64_t tile_bytes ){
+    // tabelle degli offset prima, poi la IFD che le punta
+    const uint64_t offsets = ftello( f );
+    for( int i=0; i<tiles; i++ ) put64( f, 16 + i*tile_bytes );
+    const uint64_t counts = ftello( f );
+    for( int i=0; i<tiles; i++ ) put64( f, tile_bytes );
+
+    const uint64_t ifd = ftello( f );
+    put64( f, 12 );     // voci, in ordine di tag
+    tiff_entry( f, 256, TIFF_LONG,  1, w );                     // ImageWidth
+    tiff_entry( f, 257, TIFF_LONG,  1, h );                     // ImageLength
+    tiff_entry( f, 258, TIFF_SHORT, 3, shorts( 32, 32, 32 ));   // BitsPerSample
+    tiff_entry( f, 259, TIFF_SHORT, 1, 1 );                     // Compression: nessuna
+    tiff_entry( f, 262, TIFF_SHORT, 1, 2 );                     // Photometric: RGB
+    tiff_entry( f, 277, TIFF_SHORT, 1, 3 );                     // SamplesPerPixel
+    tiff_entry( f, 284, TIFF_SHORT, 1, 1 );                     // PlanarConfig: interlacciato
+    tiff_entry( f, 322, TIFF_LONG,  1, tile );                  // TileWidth
+    tiff_entry( f, 323, TIFF_LONG,  1, tile );                  // TileLength
+    tiff_entry( f, 324, TIFF_LONG8, tiles, tiles > 1 ? offsets : 16 );          // TileOffsets
+    tiff_entry( f, 325, TIFF_LONG8, tiles, tiles > 1 ? counts  : tile_bytes );  // TileByteCounts
+    tiff_entry( f, 339, TIFF_SHORT, 3, shorts( 3, 3, 3 ));      // SampleFormat: float
+    put64( f, 0 );      // nessuna IFD dopo
+
+    assert( !fseeko( f, 0, SEEK_SET ));
+    tiff_header( f, ifd );
+}
+
+
+
+
+static void usage( const char *argv0 ){
+    fprintf( stderr,
+        "usage: %s [options] scene.obj\n"
+        "  -g WxH     image size (default 16384x9216)\n"
+        "  -t SIZE    tile side, multiple of 16 (default 256)\n"
+        "  -s SPP     samples per pixel (default 64)\n"
+        "  -l LEVELS  build the index lazily, LEVELS levels per visit\n"
+        "  -v         use the view saved in last.txt\n"
+        "  -o FILE    BigTIFF output, float RGB (default tiled.tif)\n"
+        , argv0 );
+    exit( 1 );
+}
+
+
+
+int main( int argc, char *argv[]){
+
+    int w = 16384, h = 9216;
+    const char *out_path = "tiled.tif";
+
+    int opt;
+    while(( opt = getopt( argc, argv, "g:t:s:l:vo:" )) != -1 ){
+        switch( opt ){
+            case 'g': if( 2 != sscanf( optarg, "%dx%d", &w, &h )) usage( argv[0] ); break;
+            case 't': tile = atoi( optarg ); break;
+            case 's': spp  = atoi( optarg ); break;
+            case 'l': SpatialIndexLazyLevels = atoi( optarg ); break;
+            case 'v': last_view = true; break;
+            case 'o': out_path = optarg; break;
+            default : usage( argv[0] );
+        }
+    }
+    if( optind >= argc || w < 1 || h < 1 || spp < 1 || tile < 16 || tile % 16 ) usage( argv[0] );
+
+    pCamera = CameraCreate();
+    camera_setup();
+    Scene *pS = SceneConstruct( argv[optind], &CameraEyePoint( pCamera ));
+    Random *r = RandomCreate();
+
+    const int tiles_x = ( w + tile - 1 ) / tile;
+    const int tiles_y = ( h + tile - 1 ) / tile;
+    const int tiles   = tiles_x * tiles_y;
+    const uint64_t tile_bytes = (uint64_t)tile * tile * 3 * sizeof(float);
+
+    // i due buffer di un tassello: radianze e pixel del file
+    V3f   *aRegion;
+    float *aTile;
+    assert( aRegion = (V3f*)malloc( (size_t)tile * tile * sizeof(V3f)));
+    assert( aTile   = (float*)malloc( tile_bytes ));
+
+    FILE *f;
+    assert( f = fopen( out_path, "wb" ));
+    tiff_header( f, 0 );    // IFD ancora da scrivere
+
+    fprintf( stderr, "tiled: %dx%d, %d tasselli da %d, %d spp -> %s\n", w, h, tiles, tile, spp, out_path );
+
+    const uint64_t t0 = prof_now();
+    for( int i=0; i<tiles; i++ ){
+        const int x0 = i % tiles_x * tile;
+        const int y0 = i / tiles_x * tile;
+        const int tw = x0 + tile < w ? tile : w - x0;
+        const int th = y0 + tile < h ? tile : h - y0;
+
+        CameraRegion( pCamera, pS, w, h, x0, y0, tw, th, spp, r, aRegion );
+
+        memset( aTile, 0, tile_bytes );
+        for( int y=0; y<th; y++ ){
+            for( int x=0; x<tw; x++ ){
+                const V3f &c = aRegion[y*tw + x];
+                float *p = &aTile[( y*tile + x )*3];
+                p[0] = c.R();
+                p[1] = c.G();
+                p[2] = c.B();
+            }
+        }
+        put( f, aTile, tile_bytes );
+
+        const double t = seconds( t0 );
+        fprintf( stderr, "tiled: %d/%d, %.1fs, ancora %.1fs\r", i+1, tiles, t, t / (i+1) * ( tiles-i-1 ));
+    }
+    fprintf( stderr, "\n" );
+
+    tiff_ifd( f, w, h, tiles, tile_bytes );
+    assert( !fclose( f ));
+
+    free( aTile );
+    free( aRegion );
+    free( r );
+    SceneDestruct( pS );
+    free( pCamera );
+    return 0;
+}
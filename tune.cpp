@@ -0,0 +1,48 @@
+
+#include <stdio.h>
+#include <SpatialIndex.h>
+
+
+// i parametri migliori dell'indice trovati da SpatialIndexTune()
+// stanno accanto alla scena, es. scenes/room.obj.tune
+// e vengono riletti alle esecuzioni successive
+
+
+
+
+static void tune_path( char *buf, int len, const char *scene_path ){
+    snprintf( buf, len, "%s.tune", scene_path );
+}
+
+
+
+void tune_save( const char *scene_path ) // HEADER
+{
+    char path[1024];
+    tune_path( path, sizeof(path), scene_path );
+    FILE *f = fopen(path,"wb");
+    if(!f)return;
+    fprintf(f,"TUNE_MAX_ITEMS %d\n",SpatialIndexMaxItems);
+    fprintf(f,"TUNE_MAX_LEVELS %d\n",SpatialIndexMaxLevels);
+    fclose(f);
+}
+
+void tune_load( const char *scene_path ) // HEADER
+{
+    char path[1024];
+    tune_path( path, sizeof(path), scene_path );
+    FILE *f = fopen(path,"rb");
+    if(!f)return;
+    // se il file è rovinato, o fuori dai valori che prova il tune,
+    // teniamo i default
+    int items, levels;
+    if( 2 == fscanf(f," TUNE_MAX_ITEMS %d TUNE_MAX_LEVELS %d", &items, &levels )
+        && SpatialIndexTuneInRange( items, levels )){
+        SpatialIndexMaxItems  = items;
+        SpatialIndexMaxLevels = levels;
+        fprintf(stderr,"%s: index items %d levels %d\n",path,items,levels);
+    }else{
+        fprintf(stderr,"%s: non valido, ignorato (rifallo con -t)\n",path);
+    }
+    fclose(f);
+}
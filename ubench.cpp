@@ -0,0 +1,327 @@
+
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <omp.h>
+
+#include <prof.h>
+#include <globals.h>
+#include <hdr.h>
+#include <Triangle.h>
+#include <SpatialIndex.h>
+#include <SurfacePoint.h>
+#include <Random.h>
+
+
+// microbenchmark dei kernel caldi, su input sintetici
+//
+//     ./ubench [-o FILE] [-r REPEATS] [FILTRO...]
+//
+// ogni kernel gira in lotti da ~10ms, ripetuti; per lotto si prende
+// ns/op, e sui lotti media e intervallo di confidenza al 95%
+// i filtri selezionano i kernel per sottostringa del nome
+//
+// i kernel di frame (firefly_filter, tonemap) girano su un thread,
+// per confrontare il codice e non lo scheduling di openmp
+
+
+
+#define N_INPUTS   1024            // potenza di 2, input ciclati con &
+#define N_RAYS     4096
+#define BATCH_NS   10000000ull     // durata obiettivo di un lotto
+
+
+static volatile uint64_t sink;     // i risultati finiscono qui, o il compilatore li butta
+
+
+static V3f       aA[N_INPUTS], aB[N_INPUTS];
+static Triangle  aTriangles[N_INPUTS];
+static V3f       aRayOrigins[N_RAYS], aRayDirections[N_RAYS];
+static SurfacePoint aSurfacePoints[N_INPUTS];
+static const SpatialIndex *pIndex;
+static Random   *pR;
+
+static V3f     *HDR_IN, *HDR_OUT;     // W*H
+static uint8_t *RGB8;
+
+
+
+
+// input ----------------------------------------------------------------------
+
+static V3f rnd3( Random *r ){
+    return V3f( RandomReal64( r ), RandomReal64( r ), RandomReal64( r ));
+}
+
+
+static void setup(){
+    Random *r = RandomCreate();
+
+    for( int i=0; i<N_INPUTS; i++ ){
+        aA[i] = rnd3( r ) - V3f( 0.5, 0.5, 0.5 );
+        aB[i] = rnd3( r ) - V3f( 0.5, 0.5, 0.5 );
+
+        // triangoli di lato ~0.05 sparsi nel cubo unitario
+        Triangle *t = &aTriangles[i];
+        const V3f c = rnd3( r );
+        t->aVertexs[0] = c;
+        t->aVertexs[1] = c + (rnd3( r ) - V3f( 0.5, 0.5, 0.5 )) * 0.1;
+        t->aVertexs[2] = c + (rnd3( r ) - V3f( 0.5, 0.5, 0.5 )) * 0.1;
+        t->reflectivity = V3f( 0.7, 0.6, 0.5 );
+        t->emitivity    = V3f::ZERO;
+    }
+
+    for( int i=0; i<N_INPUTS; i++ ){
+        const V3f p = aTriangles[i].aVertexs[0];
+        aSurfacePoints[i] = SurfacePointCreate( &aTriangles[i], &p );
+    }
+
+    // raggi fissi dall'occhio verso il cubo, la metà circa colpisce
+    const V3f eye( 0.5, 0.5, -1.0 );
+    for( int i=0; i<N_RAYS; i++ ){
+        aRayOrigins[i]    = eye;
+        aRayDirections[i] = ( rnd3( r ) - eye ).normalized();
+    }
+    pIndex = SpatialIndexConstruct( &eye, aTriangles, N_INPUTS );
+
+    // hdr con un po' di fireflies
+    assert( HDR_IN  = (V3f*)malloc( W*H*sizeof(V3f)));
+    assert( HDR_OUT = (V3f*)malloc( W*H*sizeof(V3f)));
+    assert( RGB8    = (uint8_t*)malloc( W*H*3 ));
+    for( int i=0; i<W*H; i++ ){
+        HDR_IN[i] = rnd3( r ) * ( RandomReal64( r ) < 0.01 ? 100.0 : 1.0 );
+    }
+
+    pR = RandomCreate();
+    free( r );
+}
+
+
+
+
+// kernel ---------------------------------------------------------------------
+
+// ognuno esegue n operazioni e restituisce qualcosa da mettere nel sink
+
+static uint64_t bits( float f ){
+    // i bit, non il valore: un float negativo convertito a unsigned è UB
+    uint32_t u;
+    memcpy( &u, &f, sizeof(u));
+    return u;
+}
+
+static uint64_t k_v3f_dot( int n ){
+    float s = 0;
+    for( int i=0; i<n; i++ ) s += aA[i&(N_INPUTS-1)].dot( aB[(i+1)&(N_INPUTS-1)] );
+    return bits( s );
+}
+
+static uint64_t k_v3f_cross( int n ){
+    V3f s = V3f::ZERO;
+    for( int i=0; i<n; i++ ) s = s + aA[i&(N_INPUTS-1)] % aB[(i+1)&(N_INPUTS-1)];
+    return bits( s.X());
+}
+
+static uint64_t k_v3f_normalized( int n ){
+    V3f s = V3f::ZERO;
+    for( int i=0; i<n; i++ ) s = s + aA[i&(N_INPUTS-1)].normalized();
+    return bits( s.X());
+}
+
+static uint64_t k_triangle_bound( int n ){
+    float s = 0;
+    for( int i=0; i<n; i++ ){
+        float aBound[6];
+        TriangleBound( &aTriangles[i&(N_INPUTS-1)], aBound );
+        s += aBound[i%6];
+    }
+    return bits( s );
+}
+
+static uint64_t k_triangle_intersection( int n ){
+    uint64_t hits = 0;
+    for( int i=0; i<n; i++ ){
+        float distance;
+        hits += TriangleIntersection( &aTriangles[i&(N_INPUTS-1)]
+            , &aRayOrigins[i&(N_RAYS-1)], &aRayDirections[i&(N_RAYS-1)], &distance );
+    }
+    return hits;
+}
+
+static uint64_t k_index_intersection( int n ){
+    uint64_t hits = 0;
+    for( int i=0; i<n; i++ ){
+        const Triangle *pHit;
+        V3f position;
+        SpatialIndexIntersection( pIndex, &aRayOrigins[i&(N_RAYS-1)], &aRayDirections[i&(N_RAYS-1)]
+            , 0, &pHit, &position );
+        hits += pHit != 0;
+    }
+    return hits;
+}
+
+static uint64_t k_random_int32u( int n ){
+    uint32_t s = 0;
+    for( int i=0; i<n; i++ ) s ^= RandomInt32u( pR );
+    return s;
+}
+
+static uint64_t k_random_real64( int n ){
+    double s = 0;
+    for( int i=0; i<n; i++ ) s += RandomReal64( pR );
+    return s;
+}
+
+static uint64_t k_next_direction( int n ){
+    uint64_t alive = 0;
+    for( int i=0; i<n; i++ ){
+        V3f out, color;
+        alive += SurfacePointNextDirection( &aSurfacePoints[i&(N_INPUTS-1)], pR
+            , &aRayDirections[i&(N_RAYS-1)], &out, &color );
+    }
+    return alive;
+}
+
+static uint64_t k_firefly_filter( int n ){
+    for( int i=0; i<n; i++ ) firefly_filter( HDR_OUT, HDR_IN );
+    return bits( HDR_OUT[H/2*W + W/2].X());
+}
+
+static uint64_t k_tonemap( int n ){
+    for( int i=0; i<n; i++ ) tonemap( RGB8, HDR_IN, 1.0 );
+    return RGB8[(H/2*W + W/2)*3];
+}
+
+
+
+static const struct {
+    const char *name;
+    const char *unit;     // cosa è un'operazione
+    uint64_t  (*run)( int n );
+} KERNELS[] = {
+    { "V3f::dot",                  "call",  k_v3f_dot               },
+    { "V3f::cross",                "call",  k_v3f_cross             },
+    { "V3f::normalized",           "call",  k_v3f_normalized        },
+    { "TriangleBound",             "call",  k_triangle_bound        },
+    { "TriangleIntersection",      "call",  k_triangle_intersection },
+    { "SpatialIndexIntersection",  "ray",   k_index_intersection    },
+    { "RandomInt32u",              "call",  k_random_int32u         },
+    { "RandomReal64",              "call",  k_random_real64         },
+    { "SurfacePointNextDirection", "call",  k_next_direction        },
+    { "firefly_filter",            "frame", k_firefly_filter        },
+    { "tonemap",                   "frame", k_tonemap               },
+};
+
+
+
+
+// misura ---------------------------------------------------------------------
+
+struct RESULT {
+    double mean_ns;     // ns/op
+    double ci95_ns;     // semiampiezza dell'intervallo al 95%
+    double min_ns;
+    int    batch;
+};
+
+
+static double batch_ns( int k, int n ){
+    const uint64_t t0 = prof_now();
+    sink += KERNELS[k].run( n );
+    return prof_now() - t0;
+}
+
+
+static RESULT measure( int k, int repeats ){
+    // lotto calibrato raddoppiando fino a BATCH_NS
+    int n = 1;
+    while( batch_ns( k, n ) < BATCH_NS && n < (1<<30)) n *= 2;
+
+    RESULT r = { 0, 0, INFINITY, n };
+    double sum = 0, sum2 = 0;
+    for( int i=0; i<repeats; i++ ){
+        const double t = batch_ns( k, n ) / n;
+        sum  += t;
+        sum2 += t*t;
+        if( t < r.min_ns ) r.min_ns = t;
+    }
+    r.mean_ns = sum / repeats;
+    const double var = repeats > 1 ? ( sum2 - sum*sum/repeats ) / ( repeats - 1 ) : 0;
+    // normale invece di t di student: con le ripetizioni di default cambia poco
+    r.ci95_ns = 1.96 * sqrt( fmax( var, 0 ) / repeats );
+    return r;
+}
+
+
+
+
+static void usage( const char *argv0 ){
+    fprintf( stderr,
+        "usage: %s [options] [filter...]\n"
+        "  -o FILE     json results\n"
+        "  -r REPEATS  timed batches per kernel (default 30)\n"
+        , argv0 );
+    exit( 1 );
+}
+
+
+
+int main( int argc, char *argv[]){
+
+    const char *out_path = 0;
+    int         repeats  = 30;
+
+    int opt;
+    while(( opt = getopt( argc, argv, "o:r:" )) != -1 ){
+        switch( opt ){
+            case 'o': out_path = optarg; break;
+            case 'r': repeats  = atoi( optarg ); break;
+            default : usage( argv[0] );
+        }
+    }
+    if( repeats < 2 ) usage( argv[0] );
+
+    omp_set_num_threads( 1 );
+    setup();
+
+    FILE *out = 0;
+    if( out_path ){
+        assert( out = fopen( out_path, "wb" ));
+        fprintf( out, "{\"repeats\":%d,\"kernels\":[\n", repeats );
+    }
+
+    printf( "%-26s %12s %10s %12s %14s\n", "kernel", "ns/op", "+-95%", "min", "ops/s" );
+
+    bool first = true;
+    for( unsigned k=0; k<COUNT(KERNELS); k++ ){
+
+        bool selected = optind >= argc;
+        for( int a=optind; a<argc; a++ ) selected |= strstr( KERNELS[k].name, argv[a] ) != 0;
+        if( !selected ) continue;
+
+        const RESULT r = measure( k, repeats );
+
+        printf( "%-26s %12.3f %10.3f %12.3f %14.0f  per %s\n"
+            , KERNELS[k].name, r.mean_ns, r.ci95_ns, r.min_ns, 1e9 / r.mean_ns, KERNELS[k].unit );
+
+        if( out ){
+            fprintf( out, "%s{\"name\":\"%s\",\"unit\":\"%s\",\"ns_per_op\":%.4f,\"ci95_ns\":%.4f"
+                ",\"min_ns\":%.4f,\"ops_per_s\":%.1f,\"batch\":%d}"
+                , first ? "" : ",\n", KERNELS[k].name, KERNELS[k].unit
+                , r.mean_ns, r.ci95_ns, r.min_ns, 1e9 / r.mean_ns, r.batch );
+        }
+        first = false;
+    }
+
+    if( out ){
+        fprintf( out, "\n]}\n" );
+        fclose( out );
+    }
+
+    SpatialIndexDestruct( (SpatialIndex*)pIndex );
+    return 0;
+}